@@ -15,402 +15,5494 @@
  *  2. Threaded multiplication with the parent waiting for all children.
  *  3. Threaded multiplication with the parent continually checking on children.
  *  4. Threaded multiplication with the parent waiting on a semaphore.
+ *     Variants wait on a futex, an eventfd or a condition variable instead.
+ *  5. Threaded multiplication with a work-stealing scheduler balancing small tasks.
+ *
+ * Instead of generating the array, it can multiply a binary file of ints (-f). A file
+ * that fits in memory is mapped and run through all schemes; a larger one is streamed
+ * through a double-buffered pipeline.
+ *
+ * With -bench it instead sweeps array sizes, thread counts and zero positions, runs each
+ * scheme repeatedly and writes min/median/p99 times as CSV or JSON.
  *
  * Compile with:
- *    gcc -O3 MTFindProd.c -o MTFindProd -lpthread
+ *    gcc -O3 MTFindProd.c -o MTFindProd -lpthread -lm
+ * or as a library without main(), see MTFindProd.h:
+ *    gcc -O3 -DMTFP_LIBRARY -c MTFindProd.c -o MTFindProd.o
  */
 
+#define _GNU_SOURCE // for cpu_set_t and pthread_attr_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <sys/time.h>
 #include <semaphore.h>
 #include <stdbool.h>
 #include <sched.h>  // for sched_yield
 #include <unistd.h> // for usleep
 #include <stdatomic.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <immintrin.h> // SSE4.1/AVX2 intrinsics for the product kernels
+#include "MTFindProd.h"
 
-#define MAX_SIZE 100000000
+// Everything outside the Mtfp* API is declared LOCAL: built as a library it then has
+// internal linkage, so that names like lock or GetTime cannot collide with the caller's.
+// The functions only main() uses are unused there
+#ifdef MTFP_LIBRARY
+#define LOCAL static __attribute__((unused))
+#else
+#define LOCAL
+#endif
+
+#define MAX_SIZE (INT_MAX - ZERO_SCAN_BLOCK) // Indices are ints; leave room for the block loops to step past the end
 #define MAX_THREADS 16
 #define RANDOM_SEED 7649
 #define MAX_RANDOM_NUMBER 3000
-#define NUM_LIMIT 9973
+#define NUM_LIMIT 9973   // Default modulus, can be changed with -m
+#define PROD_BLOCK 16384       // Elements (64 KB) the threaded schemes multiply between two checks of found_zero
+#define ZERO_SCAN_BLOCK 262144 // Elements (1 MB) the zero pre-scan covers between two checks of found_zero
+#define STEAL_TASK_SIZE 65536  // Elements per task of the work-stealing scheduler
+#define STREAM_CHUNK 16777216  // Default elements (64 MB) per chunk when streaming an input file
+
+// The SIMD kernels keep signed residues |acc| <= modulus in doubles and multiply at least
+// one element in before reducing, which is only exact while 2 * modulus * element < 2^50
+_Static_assert(MTFP_MAX_ELEMENT == MAX_RANDOM_NUMBER, "The library must promise the element range the kernels assume");
+_Static_assert(2.0 * 4294967296.0 * MAX_RANDOM_NUMBER < 1125899906842624.0,
+               "2^33 * MAX_RANDOM_NUMBER must stay below 2^50 for the SIMD product kernels");
+
+// The modulus products are reduced by, together with its reduction constants
+// Filled in once by InitModulus(); MODULUS_CONST builds one at compile time
+typedef struct
+{
+    uint32_t value;   // The modulus, 2 <= value < 2^32
+    uint64_t barrett; // floor(2^64 / value), for the Barrett reduction in ModReduce
+    double inv;       // 1.0 / value, for the reciprocal reduction in the SIMD kernels
+    int scalarGroup;  // Elements the scalar kernel multiplies in per reduction (2 or 4)
+    int simdDepth;    // Elements the SIMD kernels multiply into a lane per reduction (1 to 3)
+} Modulus;
+
+#define MODULUS_CONST(m, group, depth) \
+    ((Modulus){(m), (uint64_t)(((unsigned __int128)1 << 64) / (m)), 1.0 / (m), (group), (depth)})
+
+// Moduli that get product kernels specialized at compile time: X(modulus, scalar group, SIMD depth)
+// The group and depth must match what InitModulus() computes for the modulus
+#define SPECIALIZED_MODULI(X) \
+    X(9973, 4, 3)             \
+    X(1000000007, 2, 1)
+
+LOCAL Modulus gMod; // Modulus used by every scheme
+
+LOCAL void InitModulus(Modulus *m, uint32_t value); // Compute the reduction constants for value
+
+// Barrett reduction of a mod m.value for any 64-bit a
+static inline uint32_t ModReduce(uint64_t a, Modulus m)
+{
+    uint64_t q = (uint64_t)(((unsigned __int128)a * m.barrett) >> 64);
+    uint64_t r = a - q * m.value;
+    return (uint32_t)(r >= m.value ? r - m.value : r);
+}
+
+static inline uint32_t ModMul(uint32_t a, uint32_t b, Modulus m)
+{
+    return ModReduce((uint64_t)a * b, m);
+}
 
 // Global variables
-volatile long gRefTime;       // For timing
-volatile int gData[MAX_SIZE]; // The array that will hold the data
+LOCAL volatile long gRefTime;       // For timing, in nanoseconds
+LOCAL int *gData;                   // The array that will hold the data, allocated by AllocData for the requested size
+LOCAL size_t gDataBytes;            // Size of the mapping behind gData
+LOCAL bool gDataInRange;            // Every element of gData is known to lie in [0, MAX_RANDOM_NUMBER], the domain of the lookup tables
+
+// How AllocData backs gData (-hugepages)
+typedef enum
+{
+    HUGEPAGES_OFF,      // Regular pages
+    HUGEPAGES_THP,      // Regular mapping with madvise(MADV_HUGEPAGE), transparent huge pages
+    HUGEPAGES_EXPLICIT, // MAP_HUGETLB from the preallocated huge page pool
+} HugePageMode;
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+LOCAL HugePageMode gHugePages = HUGEPAGES_THP;
+
+LOCAL void AllocData(int size); // Map gData for size elements
+LOCAL void FreeData(void);      // Unmap gData
+
+// Input files hold the elements as native-endian 32-bit ints in [0, MAX_RANDOM_NUMBER];
+// mapped and streamed files are checked and rejected otherwise
+LOCAL long long DataFileElements(const char *path);     // Number of elements in an input file
+LOCAL void MapDataFile(const char *path, int size);     // Map the first size elements of an input file as gData
+LOCAL void DataRange(int size, int64_t *range);         // Minimum and maximum of the first size elements of gData
+LOCAL bool DataInRange(int size);                       // Whether they lie in [0, MAX_RANDOM_NUMBER]
+LOCAL bool DataFileFitsInRam(long long count);          // Whether count elements can be mapped without paging
+
+LOCAL volatile int gThreadCount;              // Number of threads
+LOCAL volatile int gDoneThreadCount;          // Number of threads that are done at a certain point. Whenever a thread is done, it increments this. Used with the semaphore-based solution
+
+#define CACHE_LINE 64
+
+// Result and status of one worker, alone in its cache line so that workers publishing
+// their results do not invalidate each other's lines (or the parent's reads). A worker
+// stores prod and then done with release semantics and takes no lock; the parent reads
+// them with acquire loads
+typedef struct
+{
+    _Alignas(CACHE_LINE) atomic_uint prod; // The modular product of the worker's division
+    atomic_bool done;                      // prod is final. Polled by the busy-checking parent
+} ThreadSlot;
+
+LOCAL ThreadSlot gThreadSlots[MAX_THREADS];
+
+LOCAL void PublishResult(int id, uint32_t product); // Store a worker's product and mark it done
+
+// Slot micro-benchmark (-slotbench): every worker publishes a result SLOT_BENCH_UPDATES
+// times into the packed arrays the schemes used before (under lock, and with plain
+// atomic stores) and into gThreadSlots, to show what the false sharing costs
+#define SLOT_BENCH_UPDATES 1000000
+
+LOCAL uint32_t gPackedProd[MAX_THREADS];  // The old layout: all results in one or two cache lines
+LOCAL bool gPackedDone[MAX_THREADS];
+LOCAL atomic_uint gPackedAtomicProd[MAX_THREADS];
+LOCAL atomic_bool gPackedAtomicDone[MAX_THREADS];
+
+LOCAL void RunSlotBenchmark(int maxThreads);
+LOCAL void *ThSlotBenchLocked(void *param);
+LOCAL void *ThSlotBenchPacked(void *param);
+LOCAL void *ThSlotBenchPadded(void *param);
+// Cooperative cancellation: set by the worker that finds a zero, checked by the others once per PROD_BLOCK
+LOCAL volatile atomic_bool found_zero = false;
+
+// Semaphores
+LOCAL sem_t completed;              // To notify parent that all threads have completed or one of them found a zero
+LOCAL sem_t mutex;                  // Binary semaphore to protect the shared variable gDoneThreadCount
+
+// Completion primitives of the other notification schemes, set up fresh for every run
+#define DONE_WORD_ZERO 0x80000000u // Set in gDoneWord when a worker found a zero
+LOCAL atomic_uint gDoneWord;             // Futex scheme: number of finished workers, plus DONE_WORD_ZERO
+LOCAL int gDoneEventFd = -1;             // Eventfd scheme: written once the product is known
+LOCAL pthread_mutex_t gDoneLock;         // Condition variable scheme: protects gDoneCount
+LOCAL pthread_cond_t gDoneCond;          // Condition variable scheme: signalled once the product is known
+LOCAL int gDoneCount;                    // Condition variable scheme: number of finished workers
+
+// Cost of the parent's wait in the last threaded scheme (-waitstats)
+LOCAL bool gWaitStats = false;
+LOCAL atomic_llong gNotifyNs;   // When a worker last notified the parent (NowNs)
+LOCAL long long gParentCpuNs;   // CPU time the parent burned from job submission until it had the product
+LOCAL long long gWakeLatencyNs; // Time from the last notification until the parent noticed it
+
+// Hardware counters (-perf). Every pool worker and the parent open their own counters,
+// which count only while a job routine (worker) or the scheme's wait (parent) runs
+typedef enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_EVENT_COUNT
+} PerfEvent;
+
+#define PERF_PARENT MAX_THREADS // Counter slot of the parent thread
+
+typedef struct
+{
+    int fd[PERF_EVENT_COUNT];          // -1 if the event is not available
+    uint64_t count[PERF_EVENT_COUNT];  // Accumulated since the last PerfReset()
+} PerfCounters;
+
+LOCAL bool gPerf = false;
+LOCAL PerfCounters gPerfCounters[MAX_THREADS + 1];
+
+LOCAL void PerfOpen(int slot);   // Open the counters of the calling thread
+LOCAL void PerfClose(int slot);  // Close them
+LOCAL void PerfStart(int slot);  // Start counting
+LOCAL void PerfStop(int slot);   // Stop counting and add to the slot's counts
+LOCAL void PerfReset(void);      // Clear the counts of every slot
+LOCAL void PrintPerfCounters(bool workers); // Print the parent's counts, and each worker's and their sum
+
+LOCAL uint32_t SqFindProd(int size);              // Sequential FindProduct (no threads) computes the product of all the elements in the array mod gMod
+LOCAL void *ThFindProd(void *param);              // Thread FindProduct but without semaphores
+LOCAL void *ThFindProdWithSemaphore(void *param); // Thread FindProduct with semaphores
+LOCAL uint32_t ComputeTotalProduct();             // Multiply the division products to compute the total modular product
+
+// Product kernels: all compute the product of n elements mod gMod and return 0 as soon
+// as the product becomes zero. Elements must lie in [0, MAX_RANDOM_NUMBER]
+typedef uint32_t (*ProdKernelFn)(const int *data, int n);
+LOCAL uint32_t ProdKernelRef(const int *data, int n);    // Reference: one dependent multiply-mod per element
+LOCAL uint32_t ProdKernelScalar(const int *data, int n); // Four independent 64-bit accumulators, lazy reduction
+LOCAL uint32_t ProdKernelSse4(const int *data, int n);   // 4 x 2 double-precision accumulators (SSE4.1)
+LOCAL uint32_t ProdKernelAvx2(const int *data, int n);   // 4 x 4 double-precision accumulators (AVX2)
+#define X(m, group, depth)                                       \
+    LOCAL uint32_t ProdKernelScalar_##m(const int *data, int n); \
+    LOCAL uint32_t ProdKernelSse4_##m(const int *data, int n);   \
+    LOCAL uint32_t ProdKernelAvx2_##m(const int *data, int n);
+SPECIALIZED_MODULI(X)
+#undef X
+LOCAL int CpuIsaLevel(void);         // Instruction set level of the CPU: 0 scalar, 1 SSE4.1, 2 AVX2
+LOCAL void SelectProdKernel(void);   // Pick the fastest kernel (and zero scan) the CPU supports for gMod
+LOCAL int SelfTestProdKernels(void); // Check every supported kernel against the reference, returns the number of failures
+
+LOCAL ProdKernelFn gProdKernel = ProdKernelScalar; // Kernel used by SqFindProd and the thread functions
+LOCAL const char *gProdKernelName = "scalar";
+
+// The generic kernels with the modulus as a parameter, for products under other moduli
+// than gMod (the reductions)
+typedef uint32_t (*ProdModKernelFn)(const int *data, int n, Modulus m);
+LOCAL uint32_t ProdKernelScalarMod(const int *data, int n, Modulus m);
+LOCAL uint32_t ProdKernelSse4Mod(const int *data, int n, Modulus m);
+LOCAL uint32_t ProdKernelAvx2Mod(const int *data, int n, Modulus m);
+
+LOCAL ProdModKernelFn gProdModKernel = ProdKernelScalarMod; // Picked by SelectProdKernel
+
+// Zero scans: return the index of the first zero among n elements, or -1 if there is none
+typedef int (*FindZeroFn)(const int *data, int n);
+LOCAL int FindZeroSse2(const int *data, int n); // 16 elements per iteration (baseline x86-64)
+LOCAL int FindZeroAvx2(const int *data, int n); // 32 elements per iteration
+
+LOCAL FindZeroFn gFindZero = FindZeroSse2; // Scan used by the zero fast path, set by SelectProdKernel
+LOCAL bool gZeroScan = false;              // Scan for a zero before multiplying (enabled with -zeroscan)
+LOCAL uint32_t ScanAndMultiply(const int *data, int n); // Zero fast path followed by the product kernel
+
+// Compact element storage (-storage): elements never exceed MAX_RANDOM_NUMBER, so most of
+// the 32 bits of gData carry nothing. PackData copies gData into gPacked as uint16_t or as
+// 12-bit pairs, and the schemes then stream half or three eighths of the bytes through
+// kernels specialized for that width
+typedef enum
+{
+    STORAGE_INT32,    // gData only
+    STORAGE_UINT16,   // gPacked holds element i in bytes 2i and 2i + 1
+    STORAGE_PACKED12, // gPacked holds elements 2k and 2k + 1 in bytes 3k to 3k + 2, low element first
+    STORAGE_AUTO,     // -storage auto: the narrowest layout the values fit, see StorageForRange
+} StorageMode;
+
+#define PACKED_PAD 16 // Bytes after the last element the SIMD loads of gPacked may read
+
+LOCAL const char *gStorageNames[] = {"int32", "uint16", "packed12", "auto"};
+LOCAL StorageMode gStorage = STORAGE_INT32; // Layout the schemes read, set by PackData
+LOCAL uint8_t *gPacked;                     // Compact copy of gData, mapped by PackData
+LOCAL size_t gPackedBytes;                  // Size of the mapping behind gPacked
+
+// Compact kernels: the product of n elements of base starting at element first
+typedef uint32_t (*PackedKernelFn)(const uint8_t *base, long first, int n);
+LOCAL uint32_t ProdKernelScalarU16(const uint8_t *base, long first, int n);
+LOCAL uint32_t ProdKernelScalarU12(const uint8_t *base, long first, int n);
+LOCAL uint32_t ProdKernelAvx2U16(const uint8_t *base, long first, int n);
+LOCAL uint32_t ProdKernelAvx2U12(const uint8_t *base, long first, int n);
+
+LOCAL PackedKernelFn gPackedKernel = ProdKernelScalarU16; // Picked by PackData for gStorage
+
+LOCAL StorageMode StorageForRange(int size);                     // Narrowest layout that holds the first size elements of gData
+LOCAL void PackData(int size, StorageMode mode, bool keepInt32); // Copy gData into gPacked, unmap gData unless keepInt32
+LOCAL void *ThPackData(void *param);                             // Pack one division
+LOCAL uint32_t ProdRange(long first, int n);                     // Product of n elements from first, in the current layout
+LOCAL int FindZeroRange(long first, int n);                      // Offset of the first zero among them, or -1
+LOCAL int GetElement(long i);                                    // Element i, in the current layout
+LOCAL void SetElement(long i, int value);                        // Set element i in gData and gPacked
+
+// Element i of a compact buffer of the given width (16 or 12 bits)
+static inline int PackedElement(const uint8_t *base, long i, int width)
+{
+    if (width == 16)
+    {
+        return ((const uint16_t *)base)[i];
+    }
+    const uint8_t *p = base + 3 * (i >> 1);
+    return (i & 1) ? (p[1] >> 4) | (p[2] << 4) : p[0] | ((p[1] & 0x0F) << 8);
+}
+
+LOCAL void InitSharedVars();
+LOCAL void GenerateInput(int size, int indexForZero);                                 // Generate the input array
+LOCAL void GenerateInputRand(int size, int indexForZero);                             // Generate the input array with rand(), as the assignment does
+LOCAL void CalculateIndices(int arraySize, int thrdCnt, int indices[MAX_THREADS][3]); // Calculate the indices to divide the array into T divisions, one division per thread
+LOCAL int GetRand(int min, int max);                                                  // Get a random number between min and max
+
+LOCAL volatile void SetTime(void);
+LOCAL volatile long GetTime(void);
+LOCAL volatile long GetCurrentTime(); // Function to get the current monotonic time in nanoseconds
+
+// Nanosecond clocks
+static inline long long NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline long long ThreadCpuNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+LOCAL pthread_mutex_t lock; // Mutex for protecting shared variables
+
+// Struct to store thread-specific data
+typedef struct
+{
+    int id;     // Thread ID
+    int start;  // Start index of the assigned array segment
+    int end;    // End index of the assigned array segment
+    int result; // Thread's computed product
+} ThreadData;
+
+// How a worker's division ended
+typedef enum
+{
+    DIVISION_DONE,      // Fully multiplied, the product is valid
+    DIVISION_ZERO,      // This worker found a zero (found_zero is set)
+    DIVISION_CANCELLED, // Another worker found a zero first
+} DivisionResult;
+
+LOCAL DivisionResult MultiplyDivision(ThreadData *data, uint32_t *product); // Compute part shared by the thread functions
+LOCAL DivisionResult ScanForZero(ThreadData *data);                         // Zero fast path of the thread functions
+LOCAL void *ThFindProdWithFutex(void *param);                               // Thread FindProduct waking the parent through a futex
+LOCAL void *ThFindProdWithEventfd(void *param);                             // Thread FindProduct waking the parent through an eventfd
+LOCAL void *ThFindProdWithCondvar(void *param);                             // Thread FindProduct waking the parent through a condition variable
+LOCAL void *ThGenerateInput(void *param); // Fill one division of gData with GetCounterRand values
+LOCAL void PlaceData(int size);           // First-touch every division of gData on its worker
+LOCAL void *ThPlaceData(void *param);     // Touch one division of gData
+
+// Counter-based random number: element i of the input is a pure function of
+// (RANDOM_SEED, i), so any thread can generate any part of the array and the result
+// does not depend on the thread count. SplitMix64 finalizer over a Weyl sequence
+static inline uint64_t SplitMix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// The value of element i, between 1 and MAX_RANDOM_NUMBER
+static inline int GetCounterRand(uint64_t i)
+{
+    uint64_t r = SplitMix64(((uint64_t)RANDOM_SEED << 40) ^ (i * 0x9e3779b97f4a7c15ULL)) >> 32;
+    return (int)((r * MAX_RANDOM_NUMBER) >> 32) + 1;
+}
+
+// Fused generate-and-multiply (-fused, -nodata): synthetic input is generated FUSED_CHUNK
+// elements at a time into a buffer that stays in L1 and multiplied right away, so the
+// elements never make the round trip through DRAM that GenerateInput and the schemes
+// make. The values are those of GenerateInput, so the products match. With -nodata gData
+// is never mapped and only the fused engines run
+#define FUSED_CHUNK 4096 // Elements (16 KB) generated and multiplied at a time
+
+LOCAL int gFusedZero = -1; // Element the fused engines replace with a zero, or -1
+
+LOCAL uint32_t FusedChunkProd(int first, int n, int *buf); // Generate elements first to first + n - 1 into buf and multiply them
+LOCAL uint32_t SqFindProdFused(int size);                  // Sequential fused engine
+LOCAL void *ThFindProdFused(void *param);                  // Thread function of the fused scheme
+
+// Job descriptor handed to the worker pool: the routine every worker runs and the
+// division of the array (as computed by CalculateIndices) that each worker runs it on
+typedef struct
+{
+    void *(*routine)(void *);    // Work routine, called with the worker's ThreadData
+    int indices[MAX_THREADS][3]; // Division number, start index and end index per worker
+} Job;
+
+// Long-lived worker pool. The threads are created once in PoolInit() and then wait
+// for jobs, so the threaded schemes only pay for the computation and the completion
+// signalling instead of pthread_create/pthread_join on every run
+typedef struct
+{
+    pthread_t tid[MAX_THREADS];
+    pthread_attr_t attr[MAX_THREADS];
+    ThreadData data[MAX_THREADS]; // Per-worker arguments of the current job
+    int size;                     // Number of workers
+    pthread_mutex_t lock;         // Protects every field below
+    pthread_cond_t start;         // Signalled when a new job is posted or the pool shuts down
+    pthread_cond_t idle;          // Signalled when the last worker finishes the current job
+    unsigned long generation;     // Incremented for every posted job
+    int busy;                     // Number of workers still running the current job
+    bool quit;                    // Set by PoolShutdown()
+    void *(*routine)(void *);     // Routine of the current job
+} WorkerPool;
+
+LOCAL WorkerPool gPool;
+
+LOCAL void PoolInit(int threadCount);   // Create the worker threads
+LOCAL void PoolSubmit(const Job *job);  // Hand a job to all workers (waits for the previous job to drain first)
+LOCAL void PoolJoin(void);              // Wait until every worker has finished the current job
+LOCAL void PoolShutdown(void);          // Stop and join the worker threads
+LOCAL void *PoolWorker(void *param);    // Main loop of a pool thread
+
+// Where PoolInit pins the workers (-affinity). Worker i runs on gAffinityCpus[i % gAffinityCount],
+// or wherever the scheduler puts it if gAffinityCount is 0. As GenerateInput touches each
+// division first on the worker that later multiplies it, pinning also keeps each division
+// in memory local to its worker
+typedef struct
+{
+    int cpu;
+    int domain; // NUMA node, or the socket if the kernel has no NUMA information
+    int core;   // Physical core within the socket
+} CpuInfo;
+
+LOCAL int gAffinityCpus[CPU_SETSIZE];
+LOCAL int gAffinityCount = 0;
+
+LOCAL void SetupAffinity(const char *policy);  // Fill gAffinityCpus for "compact", "scatter" or a CPU list
+LOCAL int ReadCpuTopology(CpuInfo *cpus);      // Topology of the CPUs this process may run on, from sysfs
+LOCAL int ParseCpuList(const char *list, int *cpus); // Parse a list like "0,2,4-7", returns the count
+
+LOCAL uint32_t RunJoinScheme(Job *job, long *elapsed);      // Threaded, parent waits for all workers to finish the job
+LOCAL uint32_t RunBusyCheckScheme(Job *job, long *elapsed); // Threaded, parent continually checks on the workers
+LOCAL uint32_t RunSemaphoreScheme(Job *job, long *elapsed); // Threaded, parent waits on the "completed" semaphore
+LOCAL uint32_t RunFutexScheme(Job *job, long *elapsed);     // Threaded, parent waits on a futex over the done count
+LOCAL uint32_t RunEventfdScheme(Job *job, long *elapsed);   // Threaded, parent blocks reading an eventfd
+LOCAL uint32_t RunCondvarScheme(Job *job, long *elapsed);   // Threaded, parent waits on a condition variable
+LOCAL void BeginWait(void);                                 // Start the wait statistics of a scheme run
+LOCAL void EndWait(void);                                   // Finish them once the parent has the product
+LOCAL uint32_t RunStealingScheme(Job *job, long *elapsed);  // Threaded, small tasks balanced by work stealing
+LOCAL uint32_t RunFusedScheme(Job *job, long *elapsed);     // Threaded fused generate-and-multiply, parent joins
+LOCAL void RunFusedEngines(Job *job, int size);             // Time and print the sequential and threaded fused engines
+
+// The threaded schemes main() runs, in order. Elapsed times are in nanoseconds
+typedef struct
+{
+    const char *name; // Short name for the benchmark output
+    const char *description;
+    uint32_t (*run)(Job *job, long *elapsed);
+} Scheme;
+
+LOCAL const Scheme gSchemes[] = {
+    {"join", "Threaded multiplication with parent waiting for all children", RunJoinScheme},
+    {"busy", "Threaded multiplication with parent continually checking on children", RunBusyCheckScheme},
+    {"semaphore", "Threaded multiplication with parent waiting on a semaphore", RunSemaphoreScheme},
+    {"futex", "Threaded multiplication with parent waiting on a futex", RunFutexScheme},
+    {"eventfd", "Threaded multiplication with parent waiting on an eventfd", RunEventfdScheme},
+    {"condvar", "Threaded multiplication with parent waiting on a condition variable", RunCondvarScheme},
+    {"stealing", "Threaded multiplication with work-stealing scheduler", RunStealingScheme},
+};
+
+#define SCHEME_COUNT ((int)(sizeof(gSchemes) / sizeof(gSchemes[0])))
+
+// Auto-tuning (thread count 0): the first run calibrates the machine and stores the
+// results in a cache file. The time of a threaded scheme with t workers on n elements is
+// modelled as its dispatch overhead plus n times the per-element time of t workers, and
+// the sequential time as n times its per-element time; TunePick() takes the minimum
+#define TUNE_SIZE 16777216 // Elements (64 MB, more than the caches) of the throughput runs
+#define TUNE_SMALL 64     // Elements per worker of the overhead runs
+#define TUNE_REPS 9       // Runs per measurement, the median is kept
+#define TUNE_SEQUENTIAL -1
+
+typedef struct
+{
+    char kernel[32];                                 // Product kernel the table was measured with
+    uint32_t modulus;
+    int cpus;                                        // CPUs this process could run on
+    int maxThreads;                                  // Thread counts measured: 1 to maxThreads
+    double seqNs;                                    // Sequential time per element
+    double elementNs[MAX_THREADS + 1];               // Time per element with t workers
+    double overheadNs[MAX_THREADS + 1][SCHEME_COUNT]; // Dispatch overhead of each scheme with t workers
+} TuneTable;
+
+LOCAL TuneTable gTune;
+
+LOCAL void LoadOrCalibrate(const char *path, bool retune); // Fill gTune from path, or calibrate and write it
+LOCAL void Calibrate(void);                                // Measure gTune on this machine
+LOCAL int TunePick(long long n, int onlyScheme, int *threads, double *predictedNs); // Best scheme (or TUNE_SEQUENTIAL) for n elements
+
+// Work-stealing scheduler: every division of the job is cut into tasks of STEAL_TASK_SIZE
+// elements that start out in the deque of the worker owning the division. The owner
+// takes tasks from the bottom of its deque; a worker whose deque is empty steals from
+// the top of the others' (Chase-Lev deque, with the C11 orderings of Le et al. 2013)
+typedef struct
+{
+    int start; // Start index of the task
+    int end;   // End index of the task
+} StealTask;
+
+typedef struct
+{
+    _Alignas(CACHE_LINE) atomic_long top;    // Oldest task, where thieves steal
+    _Alignas(CACHE_LINE) atomic_long bottom; // One past the newest task, where the owner takes
+} TaskDeque;
+
+#define DEQUE_EMPTY -1 // DequeTake/DequeSteal found no task
+#define DEQUE_ABORT -2 // DequeSteal lost a race and may retry
+
+LOCAL StealTask *gStealTasks;               // All tasks of the current stealing job
+LOCAL TaskDeque gDeques[MAX_THREADS];       // One deque per worker
+LOCAL void InitStealTasks(const Job *job);  // Cut the job's divisions into tasks and fill the deques
+LOCAL long DequeTake(TaskDeque *deque);     // Owner: newest task, or DEQUE_EMPTY
+LOCAL long DequeSteal(TaskDeque *deque);    // Thief: oldest task, DEQUE_EMPTY or DEQUE_ABORT
+LOCAL void *ThFindProdStealing(void *param); // Thread function of the work-stealing scheme
+
+// Multi-process scheme (-procs): the same divisions multiplied by worker processes, for
+// setups that need each worker in its own process (own cgroup, CPU limits, crash domain).
+// The workers are forked once and persist like the pool threads. gData then lives in a
+// shm_open segment, as producer.c's InitShm sets one up, which each worker maps read-only
+// without copying; the control header is a shared anonymous mapping inherited by fork.
+// The futexes in it are process-shared (no FUTEX_PRIVATE_FLAG)
+typedef struct
+{
+    _Alignas(CACHE_LINE) atomic_uint prod; // Product of the worker's division
+} ProcSlot;
+
+typedef struct
+{
+    _Alignas(CACHE_LINE) atomic_uint jobSeq; // Futex word the workers wait on, bumped for every job
+    bool quit;                               // Set with the last bump: the workers exit
+    unsigned dataGen;                        // Generation of the gData segment, the workers remap it when it changes
+    size_t dataBytes;                        // Its size
+    char dataName[64];                       // Its shm_open name
+    int indices[MAX_THREADS][3];             // Divisions of the current job
+    _Alignas(CACHE_LINE) atomic_uint doneWord; // Futex word of the parent: finished workers, plus DONE_WORD_ZERO
+    _Alignas(CACHE_LINE) atomic_bool foundZero; // found_zero of the worker processes
+    ProcSlot slots[MAX_THREADS];
+} ProcHeader;
+
+typedef struct
+{
+    ProcHeader *header; // Shared with the workers
+    pid_t pid[MAX_THREADS];
+    int size;           // Number of worker processes, 0 when none are running
+    unsigned startSeq;  // jobSeq when they were forked
+} ProcPool;
+
+LOCAL ProcPool gProcs;
+
+LOCAL bool gShmData = false;  // AllocData maps gData from a shm_open segment (set with -procs)
+LOCAL char gShmDataName[64];  // Name of the current segment
+LOCAL unsigned gShmDataGen;   // Bumped by AllocData for every segment
+
+LOCAL void ProcPoolInit(int count);                         // Fork count worker processes
+LOCAL void ProcPoolShutdown(void);                          // Stop and reap them
+LOCAL void ProcReset(void);                                 // Clear the results of the last job
+LOCAL void ProcWorker(int id);                              // Main loop of a worker process, never returns
+LOCAL uint32_t RunProcessScheme(Job *job, long *elapsed);   // Multi-process, parent waits on the shared futex
+
+// Range-product index (-index): a segment tree over gData answering the product of any
+// range [l, r] mod gMod and taking point updates, both in O(log n). The tree is stored
+// implicitly in BFS order (node k has children 2k and 2k+1, the leaves are nodes
+// leaves..2*leaves-1), so a query or update walks one node per level and the hot top
+// levels share a few cache lines. Each node keeps the product of the non-zero residues
+// below it and how many residues are zero, so an update that removes the last zero of a
+// range restores its product without rescanning the range
+typedef struct
+{
+    uint32_t prod;  // Product mod gMod of the residues that are not zero
+    uint32_t zeros; // Number of residues that are zero
+} IndexNode;
+
+typedef struct
+{
+    IndexNode *nodes; // 2 * leaves nodes, nodes[0] unused
+    int leaves;       // Power of two >= size
+    int size;         // Number of elements indexed
+    int blocks;       // Subtrees built by the workers in parallel (power of two)
+    size_t bytes;     // Size of the mapping behind nodes
+} RangeIndex;
+
+LOCAL RangeIndex gIndex;
+
+LOCAL void IndexBuild(int size);                 // Build gIndex over the first size elements of gData
+LOCAL void *ThIndexBuild(void *param);           // Build the subtrees of one worker
+LOCAL void IndexUpdate(int i, int value);        // Set gData[i] to value and update gIndex
+LOCAL uint32_t IndexQuery(int l, int r);         // Product of gData[l..r] mod gMod
+LOCAL void IndexFree(void);                      // Unmap gIndex
+LOCAL void RunIndexCheck(int size, int queries); // Check gIndex against the sequential product and time it
+
+// Reductions (-reduce): associative operators over gData with an identity. Any number of
+// them are computed in one fused pass: every worker walks its CalculateIndices division
+// in blocks of REDUCE_BLOCK elements, small enough to stay in L1/L2, and folds each block
+// into every reduction before moving on, so the array is read from memory only once
+// whatever the number of reductions. The results are 64-bit integers. The common
+// reductions are folded by inline loops over int states that vectorize; only the
+// others (products) are called through their fold pointer
+#define MAX_REDUCERS 8
+#define REDUCE_BLOCK 8192 // Elements (32 KB) folded into every reduction at a time
+
+typedef enum
+{
+    REDUCE_SUM,
+    REDUCE_MIN,
+    REDUCE_MAX,
+    REDUCE_ZEROS,
+    REDUCE_GENERIC, // Folded through fold
+} ReduceKind;
+
+typedef struct Reducer Reducer;
+struct Reducer
+{
+    char name[24];
+    ReduceKind kind;
+    int64_t identity;
+    int64_t (*fold)(int64_t acc, const int *data, int n, const Reducer *r); // Fold n elements into acc (REDUCE_GENERIC)
+    int64_t (*combine)(int64_t a, int64_t b, const Reducer *r);             // Combine two partial states
+    Modulus mod;                                                            // The modulus of a product
+};
+
+// Partial states of one worker, in cache lines of their own
+typedef struct
+{
+    _Alignas(CACHE_LINE) int64_t acc[MAX_REDUCERS];
+} ReduceSlot;
+
+LOCAL const Reducer *gReducers; // Reductions of the current job
+LOCAL int gReducerCount;
+LOCAL ReduceSlot gReduceSlots[MAX_THREADS];
+
+LOCAL int ParseReducers(const char *list, Reducer *reducers); // "sum,min,max,zeros,prod:<m>", returns the count
+LOCAL void RunReductions(const Reducer *reducers, int count, Job *job, int64_t *results); // One fused pass on the pool
+LOCAL void *ThReduce(void *param);                                                        // Fold one division
+LOCAL void ReduceDivisionSse2(ThreadData *data);                                          // Its loops for baseline x86-64
+LOCAL void ReduceDivisionAvx2(ThreadData *data);                                          // The same loops for AVX2
+LOCAL void (*gReduceDivision)(ThreadData *data) = ReduceDivisionSse2;                     // Picked by SelectProdKernel
+
+// Library batches (MTFindProd.h). While the library is running every pool worker sits
+// in ThServeBatches taking packs off the batch queue. A pack is either several whole
+// arrays of at most LIB_PACK_ELEMENTS elements in total, or one LIB_PACK_ELEMENTS piece of
+// a larger array; the pieces of an array are folded into its product as they finish
+#define LIB_PACK_ELEMENTS 65536
+
+typedef struct
+{
+    int first;  // First array of the pack
+    int last;   // Last array of the pack
+    int offset; // Piece of array first, if length >= 0
+    int length; // -1 for whole arrays
+} LibPack;
+
+typedef struct
+{
+    atomic_int pending; // Pieces of the array that are not multiplied yet
+    atomic_uint prod;   // Product of the pieces that are
+} LibArrayState;
+
+struct MtfpBatch
+{
+    const MtfpArray *arrays;
+    int count;
+    uint32_t *results;
+    MtfpCallback callback;
+    void *user;
+    LibPack *packs;
+    int packCount;
+    int nextPack;          // Next pack to hand out, under gLibLock
+    LibArrayState *state;
+    atomic_int remaining;  // Arrays that are not done yet
+    atomic_bool done;
+    MtfpBatch *next;       // Next batch in the queue
+};
+
+LOCAL pthread_mutex_t gLibLock;     // Protects the queue and gLibQuit
+LOCAL pthread_cond_t gLibWork;      // Signalled when a batch is queued or the library stops
+LOCAL pthread_cond_t gLibDone;      // Broadcast when a batch is done
+LOCAL MtfpBatch *gLibHead, *gLibTail; // Batches with packs left to hand out
+LOCAL bool gLibQuit;
+LOCAL bool gLibRunning = false;
+
+LOCAL void *ThServeBatches(void *param);                       // Worker loop of the library
+LOCAL void LibFinishArray(MtfpBatch *batch, int i, uint32_t prod); // Report one array
+
+// Discrete-log engine (-dlog): for a prime modulus p every element x that is not 0 mod p
+// is g^log(x) for a primitive root g, so the product is g^(sum of the logs mod p - 1).
+// The logs of 0..MAX_RANDOM_NUMBER come from a table small enough for L1, the sum is a
+// plain 64-bit addition that vectorizes (AVX2 gathers) and splits across workers, and a
+// single exponentiation gives the product. Elements that are 0 mod p have LOG_ZERO in the
+// table, which shows up in the sum of a block as a zero count above bit 40
+#define LOG_MAX_MODULUS (1u << 22) // Building the table walks all powers of g
+#define LOG_ZERO (1ULL << 40)      // Larger than the log sum of any PROD_BLOCK elements
+
+typedef uint64_t (*LogSumFn)(const int *data, int n);
+
+typedef struct
+{
+    bool ready;                            // The modulus is prime and at most LOG_MAX_MODULUS
+    uint32_t root;                         // Primitive root g
+    uint32_t order;                        // p - 1, the logs are taken mod order
+    uint64_t table[MAX_RANDOM_NUMBER + 1]; // log_g(x mod p), or LOG_ZERO
+    LogSumFn sum;                          // Sum of the logs of a block, picked for the CPU
+} LogEngine;
+
+LOCAL LogEngine gLog;
+
+LOCAL bool InitLogEngine(void);                        // Build gLog for gMod, false if the modulus does not allow it
+LOCAL uint64_t LogSumScalar(const int *data, int n);   // Four 64-bit accumulators
+LOCAL uint64_t LogSumAvx2(const int *data, int n);     // 2 x 4 lanes of 64-bit gathers (AVX2)
+LOCAL DivisionResult LogSumDivision(ThreadData *data, uint32_t *logSum); // Log sum of a division mod order
+LOCAL bool LogEngineFits(void);                        // gLog is ready and gData is within its table
+LOCAL uint32_t SqFindProdLog(int size);                // Sequential, falls back to SqFindProd
+LOCAL void *ThFindProdLog(void *param);                // Thread function of the discrete-log scheme
+LOCAL uint32_t RunLogScheme(Job *job, long *elapsed);  // Threaded, falls back to RunJoinScheme
+LOCAL uint32_t ModPow(uint32_t base, uint64_t exp, Modulus m);
+
+// Histogram engine (-hist): the elements take at most HIST_DOMAIN values, so instead of
+// multiplying n elements the workers count how often each value occurs in their division
+// and the product is the product of v^count(v) over the values. The second phase splits
+// the values among the workers, each adding up the counts of its values over all the
+// histograms and publishing the product of their powers; ComputeTotalProduct combines them
+#define HIST_DOMAIN (MAX_RANDOM_NUMBER + 1)
+#define HIST_MIN_RATIO 16 // Picked with at least this many elements per value
+
+// Four interleaved tables, so that runs of equal values do not serialize on one counter
+typedef struct
+{
+    _Alignas(CACHE_LINE) uint32_t count[4][HIST_DOMAIN];
+} Histogram;
+
+LOCAL Histogram *gHistograms; // One per worker
+
+LOCAL void HistogramCount(const int *data, int n, Histogram *h); // Add n elements to h
+LOCAL uint32_t HistogramProduct(int first, int last, int histograms); // Product of v^count(v) for v in [first, last]
+LOCAL DivisionResult HistogramDivision(ThreadData *data);        // Count one division into its worker's histogram
+LOCAL void *ThHistogramCount(void *param);                       // Phase 1 of the threaded histogram scheme
+LOCAL void *ThHistogramPower(void *param);                       // Phase 2
+LOCAL uint32_t SqFindProdHist(int size);                         // Sequential histogram engine
+LOCAL uint32_t RunHistogramScheme(Job *job, long *elapsed);      // Threaded histogram engine
+LOCAL bool HistogramPays(int size);                              // Whether the input suits the histogram engine
+LOCAL void RunHistogramEngines(Job *job, int size);              // Time and print the sequential and threaded histogram engines
+
+// Options that may follow the three positional arguments, see ParseOptions
+typedef struct
+{
+    unsigned long modulus; // -m
+    bool selfTest;         // -selftest
+    bool randInput;        // -randinput
+    const char *inputFile; // -f
+    bool stream;           // -stream
+    int chunk;             // -chunk
+    bool bench;            // -bench
+    bool slotBench;        // -slotbench
+    int indexQueries;      // -index
+    const char *reduce;    // -reduce
+    bool dlog;             // -dlog
+    bool hist;             // -hist
+    int warmup;            // -warmup
+    int reps;              // -reps
+    const char *sizes;     // -sizes
+    const char *threads;   // -threads
+    const char *zeros;     // -zeros
+    const char *format;    // -format
+    const char *outFile;   // -o
+    const char *affinity;  // -affinity
+    const char *tuneFile;  // -tunefile
+    bool retune;           // -retune
+    StorageMode storage;   // -storage
+    bool procs;            // -procs
+    bool fused;            // -fused
+    bool noData;           // -nodata
+} Options;
+
+LOCAL void ParseOptions(int argc, char *argv[], Options *opt); // Parse argv[4..]
+
+// Benchmark mode (-bench): every scheme, including the sequential one, is run warmup
+// times untimed and then reps times timed for each combination of array size, thread
+// count and zero position, and the min/median/p99/mean times are written as CSV or JSON
+#define MAX_SWEEP 64 // Most values in one sweep list
+
+LOCAL void RunBenchmark(const Options *opt, int arraySize, int threadCount, int indexForZero);
+LOCAL int ParseIntList(const char *list, int *values);                   // Parse "a,b,c" into values, returns the count
+LOCAL int ZeroIndexFor(const char *token, int size);                     // "-1", an index, or a percentage of size such as "50%"
+LOCAL void WriteBenchRow(FILE *out, const Options *opt, bool first, int size, int threads, int zero, const char *scheme, long *samples, uint32_t prod);
+
+// Streaming input: a reader thread fills two chunk buffers in turn from the input file
+// while the pool multiplies the other one
+typedef struct
+{
+    int fd;               // Input file
+    long long count;      // Elements to read
+    long long zeroIndex;  // Element to overwrite with a zero, or -1
+    int chunk;            // Elements per buffer
+    int *buf[2];          // The two chunk buffers
+    int len[2];           // Elements in each filled buffer, 0 marks the end of the input
+    sem_t empty;          // Buffers the reader may fill
+    sem_t full;           // Buffers ready to be multiplied
+    atomic_bool stop;     // Set by the consumer to stop the reader early
+} StreamState;
+
+LOCAL void *StreamReader(void *param); // Reader thread of the streaming scheme
+LOCAL uint32_t RunStreamingScheme(Job *job, const char *path, long long count, long long indexForZero, int chunk, long *elapsed);
+
+#ifndef MTFP_LIBRARY
+int main(int argc, char *argv[])
+{
+    Job job;
+    Options opt;
+    int indexForZero, arraySize;
+    long long size, fileElements = 0;
+    uint32_t prod;
+    long elapsed;
+
+    // Code for parsing and checking command-line arguments
+    if (argc < 4)
+    {
+        fprintf(stderr, "Invalid number of arguments!\n");
+        exit(-1);
+    }
+    ParseOptions(argc, argv, &opt);
+
+    // With an input file, an array size of 0 means the whole file
+    size = strtoll(argv[1], NULL, 10);
+    if (opt.inputFile != NULL)
+    {
+        fileElements = DataFileElements(opt.inputFile);
+        if (size == 0)
+        {
+            size = fileElements;
+        }
+        if (size > fileElements)
+        {
+            fprintf(stderr, "Array size exceeds the %lld elements in %s\n", fileElements, opt.inputFile);
+            exit(-1);
+        }
+        // Stream what cannot be mapped and indexed as a whole
+        if (size > MAX_SIZE || !DataFileFitsInRam(size))
+        {
+            opt.stream = true;
+        }
+    }
+    if (size <= 0 || (size > MAX_SIZE && !opt.stream))
+    {
+        fprintf(stderr, "Invalid Array Size\n");
+        exit(-1);
+    }
+    arraySize = (size > MAX_SIZE) ? MAX_SIZE : (int)size;
+    gThreadCount = atoi(argv[2]);
+    bool autoTune = (gThreadCount == 0);
+    if (gThreadCount > MAX_THREADS || gThreadCount < 0 || (autoTune && (opt.bench || opt.slotBench)))
+    {
+        fprintf(stderr, "Invalid Thread Count\n");
+        exit(-1);
+    }
+    indexForZero = atoi(argv[3]);
+    if (indexForZero < -1 || indexForZero >= size)
+    {
+        fprintf(stderr, "Invalid index for zero!\n");
+        exit(-1);
+    }
+
+    if (opt.bench && opt.inputFile != NULL)
+    {
+        fprintf(stderr, "-bench runs on generated input only\n");
+        exit(-1);
+    }
+    if (opt.fused && (opt.inputFile != NULL || opt.randInput || opt.bench))
+    {
+        fprintf(stderr, "-fused and -nodata generate their own input and cannot be combined with -f, -randinput or -bench\n");
+        exit(-1);
+    }
+    if (opt.procs && (opt.inputFile != NULL || opt.noData || opt.storage != STORAGE_INT32))
+    {
+        fprintf(stderr, "-procs runs on generated int32 input only\n");
+        exit(-1);
+    }
+    gShmData = opt.procs;
+    gPerf = gPerf && !opt.bench; // The benchmark rows have no room for the counters
+
+    InitModulus(&gMod, (uint32_t)opt.modulus);
+    SelectProdKernel();
+    if (opt.selfTest)
+    {
+        if (SelfTestProdKernels() != 0)
+        {
+            exit(-1);
+        }
+        printf("Product kernel self-test passed, using the %s kernel\n", gProdKernelName);
+    }
+
+    if (opt.affinity != NULL)
+    {
+        SetupAffinity(opt.affinity);
+    }
+
+    int autoScheme = TUNE_SEQUENTIAL;
+    if (autoTune)
+    {
+        double predicted;
+        int threads;
+
+        LoadOrCalibrate(opt.tuneFile, opt.retune);
+        // The streaming scheme runs the join scheme once per chunk
+        autoScheme = TunePick(opt.stream ? (size < opt.chunk ? size : opt.chunk) : size, opt.stream ? 0 : -1, &threads, &predicted);
+        gThreadCount = threads;
+        printf("Auto-tuned for %lld elements: %s with %d thread%s, predicted %.3f ms\n", size,
+               (autoScheme == TUNE_SEQUENTIAL) ? "sequential" : gSchemes[autoScheme].name, gThreadCount,
+               gThreadCount == 1 ? "" : "s", (opt.stream ? predicted * ((size + opt.chunk - 1) / opt.chunk) : predicted) / 1e6);
+    }
+
+    // The threads are started once and reused by the input generation and every
+    // threaded scheme below
+    pthread_mutex_init(&lock, NULL);
+    PoolInit(gThreadCount);
+    if (opt.procs)
+    {
+        ProcPoolInit(gThreadCount);
+    }
+    if (gPerf)
+    {
+        PerfOpen(PERF_PARENT);
+    }
+
+    if (opt.slotBench)
+    {
+        RunSlotBenchmark(gThreadCount);
+        PoolShutdown();
+        pthread_mutex_destroy(&lock);
+        return 0;
+    }
+
+    if (opt.bench)
+    {
+        RunBenchmark(&opt, arraySize, gThreadCount, indexForZero);
+        ProcPoolShutdown();
+        PoolShutdown();
+        free(gStealTasks);
+        pthread_mutex_destroy(&lock);
+        return 0;
+    }
+
+    if (opt.stream)
+    {
+        // The input does not fit in memory: only the streaming scheme can run
+        prod = RunStreamingScheme(&job, opt.inputFile, size, indexForZero, opt.chunk, &elapsed);
+        printf("Streaming multiplication of %lld elements completed in %.3f ms. Product = %u\n", size, elapsed / 1e6, prod);
+        if (gPerf)
+        {
+            PrintPerfCounters(true);
+            PerfClose(PERF_PARENT);
+        }
+        PoolShutdown();
+        pthread_mutex_destroy(&lock);
+        return 0;
+    }
+
+    gFusedZero = indexForZero;
+    if (opt.noData)
+    {
+        // Nothing to map: the fused engines generate every element where they multiply it
+        CalculateIndices(arraySize, gThreadCount, job.indices);
+        RunFusedEngines(&job, arraySize);
+        if (gPerf)
+        {
+            PerfClose(PERF_PARENT);
+        }
+        PoolShutdown();
+        pthread_mutex_destroy(&lock);
+        return 0;
+    }
+
+    if (opt.inputFile != NULL)
+    {
+        MapDataFile(opt.inputFile, arraySize);
+        gDataInRange = DataInRange(arraySize);
+        if (!gDataInRange)
+        {
+            // The product kernels are only exact for elements up to MAX_RANDOM_NUMBER
+            fprintf(stderr, "%s holds elements outside [0, %d]\n", opt.inputFile, MAX_RANDOM_NUMBER);
+            exit(-1);
+        }
+        if (indexForZero >= 0)
+        {
+            gData[indexForZero] = 0; // Private mapping: only this page is copied
+        }
+    }
+    else
+    {
+        AllocData(arraySize);
+        if (opt.randInput)
+        {
+            if (gAffinityCount > 0)
+            {
+                PlaceData(arraySize); // rand() runs on the parent only
+            }
+            GenerateInputRand(arraySize, indexForZero);
+        }
+        else
+        {
+            GenerateInput(arraySize, indexForZero);
+        }
+    }
+
+    if (opt.storage != STORAGE_INT32)
+    {
+        StorageMode fits = StorageForRange(arraySize);
+        StorageMode mode = (opt.storage == STORAGE_AUTO) ? fits : opt.storage;
+        size_t intBytes = gDataBytes;
+
+        if (mode > fits)
+        {
+            fprintf(stderr, "The elements do not fit %s storage\n", gStorageNames[mode]);
+            exit(-1);
+        }
+        // The engines after the schemes only read int32 elements
+        PackData(arraySize, mode, opt.hist || opt.dlog || opt.reduce != NULL || opt.indexQueries > 0);
+        if (gStorage != STORAGE_INT32)
+        {
+            printf("Storing %d elements as %s: %.1f MB instead of %.1f MB\n", arraySize, gStorageNames[gStorage],
+                   (gPackedBytes - PACKED_PAD) / 1e6, intBytes / 1e6);
+        }
+    }
+
+    CalculateIndices(arraySize, gThreadCount, job.indices);
+
+    // Code for the sequential part
+    if (!autoTune || autoScheme == TUNE_SEQUENTIAL)
+    {
+        PerfReset();
+        SetTime();
+        PerfStart(PERF_PARENT);
+        prod = SqFindProd(arraySize);
+        PerfStop(PERF_PARENT);
+        elapsed = GetTime();
+        printf("Sequential multiplication completed in %.3f ms. Product = %u\n", elapsed / 1e6, prod);
+        if (gPerf)
+        {
+            PrintPerfCounters(false);
+        }
+    }
+
+    // Threaded schemes, all on the same data (only the picked one when auto-tuned)
+    for (int s = 0; s < SCHEME_COUNT; s++)
+    {
+        if (autoTune && s != autoScheme)
+        {
+            continue;
+        }
+        PerfReset();
+        prod = gSchemes[s].run(&job, &elapsed);
+        printf("%s completed in %.3f ms. Product = %u\n", gSchemes[s].description, elapsed / 1e6, prod);
+        if (gWaitStats)
+        {
+            printf("    parent CPU %.3f ms, wake-up latency %.1f us\n", gParentCpuNs / 1e6, gWakeLatencyNs / 1e3);
+        }
+        if (gPerf)
+        {
+            PrintPerfCounters(true);
+        }
+    }
+
+    if (opt.procs)
+    {
+        prod = RunProcessScheme(&job, &elapsed);
+        printf("Multi-process multiplication with parent waiting on a shared futex completed in %.3f ms. Product = %u\n", elapsed / 1e6, prod);
+    }
+
+    if (opt.fused)
+    {
+        RunFusedEngines(&job, arraySize);
+    }
+
+    if (opt.hist || (!autoTune && HistogramPays(arraySize)))
+    {
+        if (!opt.hist)
+        {
+            printf("Histogram engine picked: %d elements over at most %d values\n", arraySize, HIST_DOMAIN);
+        }
+        else if (!gDataInRange)
+        {
+            printf("Histogram engine only counts elements up to %d, falling back to the product kernels\n", MAX_RANDOM_NUMBER);
+        }
+        RunHistogramEngines(&job, arraySize);
+    }
+
+    if (opt.dlog)
+    {
+        SetTime();
+        bool ready = InitLogEngine();
+        elapsed = GetTime();
+        if (ready)
+        {
+            printf("Discrete-log table for modulus %u (primitive root %u) built in %.3f ms\n", gMod.value, gLog.root, elapsed / 1e6);
+        }
+        else
+        {
+            printf("Discrete-log engine needs a prime modulus up to %u, falling back to the product kernels\n", LOG_MAX_MODULUS);
+        }
+        if (ready && !LogEngineFits())
+        {
+            printf("Discrete-log table only covers elements up to %d, falling back to the product kernels\n", MAX_RANDOM_NUMBER);
+        }
+        SetTime();
+        prod = SqFindProdLog(arraySize);
+        elapsed = GetTime();
+        printf("Sequential discrete-log multiplication completed in %.3f ms. Product = %u\n", elapsed / 1e6, prod);
+        prod = RunLogScheme(&job, &elapsed);
+        printf("Threaded discrete-log multiplication completed in %.3f ms. Product = %u\n", elapsed / 1e6, prod);
+    }
+
+    if (opt.reduce != NULL)
+    {
+        Reducer reducers[MAX_REDUCERS];
+        int64_t results[MAX_REDUCERS], single;
+        int count = ParseReducers(opt.reduce, reducers);
+        long separate = 0;
+
+        for (int r = 0; r < count; r++)
+        {
+            SetTime();
+            RunReductions(&reducers[r], 1, &job, &single);
+            separate += GetTime();
+        }
+        SetTime();
+        RunReductions(reducers, count, &job, results);
+        elapsed = GetTime();
+        printf("Fused reduction of %d statistics completed in %.3f ms (one pass each: %.3f ms)\n", count, elapsed / 1e6, separate / 1e6);
+        for (int r = 0; r < count; r++)
+        {
+            printf("    %s = %lld\n", reducers[r].name, (long long)results[r]);
+        }
+    }
+
+    if (opt.indexQueries > 0)
+    {
+        RunIndexCheck(arraySize, opt.indexQueries); // Updates gData, so it runs last
+    }
+
+    if (gPerf)
+    {
+        PerfClose(PERF_PARENT);
+    }
+    ProcPoolShutdown();
+    PoolShutdown();
+    free(gStealTasks);
+    FreeData();
+    pthread_mutex_destroy(&lock);
+    return 0;
+}
+#endif // MTFP_LIBRARY
+
+// Parse the options that may follow the three positional arguments. A thread count of 0
+// auto-tunes: only the scheme and thread count predicted to be fastest for the array size
+// run, see TunePick
+//   -m <modulus>  reduce the products by modulus (2 to 2^32 - 1) instead of NUM_LIMIT
+//   -selftest     check the product kernels against the reference before running
+//   -zeroscan     scan for a zero before multiplying
+//   -randinput    generate the input serially with rand(), as the assignment specifies
+//   -procs        after the threaded schemes, also run the multi-process scheme (in -bench
+//                 too); gData is then allocated in shared memory
+//   -fused        after the schemes, also run the fused engines that generate the input
+//                 in cache-sized chunks and multiply each chunk right away
+//   -nodata       run only the fused engines, without ever mapping gData
+//   -hugepages <off|thp|explicit>  page size backing gData (default thp)
+//   -storage <int32|16|12|auto>  element layout the schemes read: 32-bit ints, uint16_t,
+//                 12-bit pairs packed into 3 bytes, or the narrowest the values fit
+//                 (default int32)
+//   -affinity <compact|scatter|cpu list>  pin the workers: compact fills one core, socket
+//                 and NUMA node after the other, scatter spreads them over the nodes and
+//                 cores first, a list like 0,2,4-7 names the CPUs (default unpinned)
+//   -tunefile <file>  calibration cache of the auto-tuning (default ~/.MTFindProd.tune)
+//   -retune       calibrate again even if the cache matches this machine
+//   -f <file>     multiply the elements of a binary file instead of generated ones
+//   -stream       stream the file in chunks even if it could be mapped
+//   -chunk <n>    elements per chunk when streaming (default STREAM_CHUNK)
+//   -waitstats    report the parent's CPU time and wake-up latency for each threaded scheme
+//   -perf         count cycles, instructions, LLC misses, branch misses and context
+//                 switches of every worker and of the parent for each scheme
+//   -hist         after the schemes, also multiply with the histogram engine; without it
+//                 the engine still runs when HistogramPays() picks it for the input
+//   -dlog         after the schemes, also multiply with the discrete-log engine (prime
+//                 moduli up to LOG_MAX_MODULUS; others fall back to the product kernels)
+//   -reduce <list>  after the schemes, compute the reductions in list (sum, min, max,
+//                 zeros, prod:<modulus>) in one fused pass, and timed one pass each
+//   -index <n>    after the schemes, build the range-product index, check n random range
+//                 queries and point updates against the sequential product and time them
+//   -slotbench    time the per-worker result publication with packed and with cache
+//                 line padded slots, for 1 up to the thread count workers
+//   -bench        benchmark mode, see RunBenchmark; the positional arguments are the
+//                 defaults of the sweeps below
+//   -warmup <n>   untimed runs per scheme before measuring (default 2)
+//   -reps <n>     timed runs per scheme (default 10)
+//   -sizes <list>    array sizes to sweep, e.g. 1000,1000000,100000000
+//   -threads <list>  thread counts to sweep, or "all" for 1 to MAX_THREADS
+//   -zeros <list>    zero positions to sweep: -1 (none), an index, or a percentage like 50%
+//   -format <csv|json>  benchmark output format (default csv)
+//   -o <file>     write the benchmark results to file instead of stdout
+void ParseOptions(int argc, char *argv[], Options *opt)
+{
+    opt->modulus = NUM_LIMIT;
+    opt->selfTest = false;
+    opt->randInput = false;
+    opt->inputFile = NULL;
+    opt->stream = false;
+    opt->chunk = STREAM_CHUNK;
+    opt->bench = false;
+    opt->slotBench = false;
+    opt->indexQueries = 0;
+    opt->reduce = NULL;
+    opt->dlog = false;
+    opt->hist = false;
+    opt->warmup = 2;
+    opt->reps = 10;
+    opt->sizes = NULL;
+    opt->threads = NULL;
+    opt->zeros = NULL;
+    opt->format = "csv";
+    opt->outFile = NULL;
+    opt->affinity = NULL;
+    opt->tuneFile = NULL;
+    opt->retune = false;
+    opt->storage = STORAGE_INT32;
+    opt->procs = false;
+    opt->fused = false;
+    opt->noData = false;
+
+    for (int i = 4; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-selftest") == 0)
+        {
+            opt->selfTest = true;
+        }
+        else if (strcmp(argv[i], "-zeroscan") == 0)
+        {
+            gZeroScan = true;
+        }
+        else if (strcmp(argv[i], "-randinput") == 0)
+        {
+            opt->randInput = true;
+        }
+        else if (strcmp(argv[i], "-procs") == 0)
+        {
+            opt->procs = true;
+        }
+        else if (strcmp(argv[i], "-fused") == 0)
+        {
+            opt->fused = true;
+        }
+        else if (strcmp(argv[i], "-nodata") == 0)
+        {
+            opt->fused = true;
+            opt->noData = true;
+        }
+        else if (strcmp(argv[i], "-hugepages") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "off") == 0)
+                gHugePages = HUGEPAGES_OFF;
+            else if (strcmp(argv[i], "thp") == 0)
+                gHugePages = HUGEPAGES_THP;
+            else if (strcmp(argv[i], "explicit") == 0)
+                gHugePages = HUGEPAGES_EXPLICIT;
+            else
+            {
+                fprintf(stderr, "Invalid huge page mode %s\n", argv[i]);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-storage") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "int32") == 0)
+                opt->storage = STORAGE_INT32;
+            else if (strcmp(argv[i], "16") == 0)
+                opt->storage = STORAGE_UINT16;
+            else if (strcmp(argv[i], "12") == 0)
+                opt->storage = STORAGE_PACKED12;
+            else if (strcmp(argv[i], "auto") == 0)
+                opt->storage = STORAGE_AUTO;
+            else
+            {
+                fprintf(stderr, "Invalid storage %s\n", argv[i]);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-tunefile") == 0 && i + 1 < argc)
+        {
+            opt->tuneFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "-retune") == 0)
+        {
+            opt->retune = true;
+        }
+        else if (strcmp(argv[i], "-affinity") == 0 && i + 1 < argc)
+        {
+            opt->affinity = argv[++i];
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            char *end;
+            opt->modulus = strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || opt->modulus < 2 || opt->modulus > UINT32_MAX)
+            {
+                fprintf(stderr, "Invalid modulus!\n");
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            opt->inputFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "-stream") == 0)
+        {
+            opt->stream = true;
+        }
+        else if (strcmp(argv[i], "-waitstats") == 0)
+        {
+            gWaitStats = true;
+        }
+        else if (strcmp(argv[i], "-perf") == 0)
+        {
+            gPerf = true;
+        }
+        else if (strcmp(argv[i], "-bench") == 0)
+        {
+            opt->bench = true;
+        }
+        else if (strcmp(argv[i], "-slotbench") == 0)
+        {
+            opt->slotBench = true;
+        }
+        else if (strcmp(argv[i], "-hist") == 0)
+        {
+            opt->hist = true;
+        }
+        else if (strcmp(argv[i], "-dlog") == 0)
+        {
+            opt->dlog = true;
+        }
+        else if (strcmp(argv[i], "-reduce") == 0 && i + 1 < argc)
+        {
+            opt->reduce = argv[++i];
+        }
+        else if (strcmp(argv[i], "-index") == 0 && i + 1 < argc)
+        {
+            opt->indexQueries = atoi(argv[++i]);
+            if (opt->indexQueries <= 0)
+            {
+                fprintf(stderr, "Invalid query count!\n");
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-warmup") == 0 && i + 1 < argc)
+        {
+            opt->warmup = atoi(argv[++i]);
+            if (opt->warmup < 0)
+            {
+                fprintf(stderr, "Invalid warm-up count!\n");
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-reps") == 0 && i + 1 < argc)
+        {
+            opt->reps = atoi(argv[++i]);
+            if (opt->reps <= 0)
+            {
+                fprintf(stderr, "Invalid repetition count!\n");
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-sizes") == 0 && i + 1 < argc)
+        {
+            opt->sizes = argv[++i];
+        }
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+        {
+            opt->threads = argv[++i];
+        }
+        else if (strcmp(argv[i], "-zeros") == 0 && i + 1 < argc)
+        {
+            opt->zeros = argv[++i];
+        }
+        else if (strcmp(argv[i], "-format") == 0 && i + 1 < argc)
+        {
+            opt->format = argv[++i];
+            if (strcmp(opt->format, "csv") != 0 && strcmp(opt->format, "json") != 0)
+            {
+                fprintf(stderr, "Invalid output format %s\n", opt->format);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            opt->outFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "-chunk") == 0 && i + 1 < argc)
+        {
+            opt->chunk = atoi(argv[++i]);
+            if (opt->chunk <= 0 || opt->chunk > MAX_SIZE)
+            {
+                fprintf(stderr, "Invalid chunk size!\n");
+                exit(-1);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Invalid option %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+    if (opt->stream && opt->inputFile == NULL)
+    {
+        fprintf(stderr, "-stream needs an input file (-f)\n");
+        exit(-1);
+    }
+}
+
+// Benchmark mode: sweep array sizes (outer), zero positions and thread counts (inner).
+// The data is generated once per size and a zero is patched in for each position, the
+// pool is restarted whenever the thread count changes, and every scheme runs on the same
+// data. Each row also records the product, so a wrong result shows up next to its time
+void RunBenchmark(const Options *opt, int arraySize, int threadCount, int indexForZero)
+{
+    int sizes[MAX_SWEEP], threads[MAX_SWEEP], sizeCount, threadCountCount;
+    char zeroList[256], *zeroTokens[MAX_SWEEP], *save;
+    int zeroCount = 0;
+    long *samples = malloc(opt->reps * sizeof(long));
+    FILE *out = stdout;
+    bool first = true;
+    Job job;
+
+    if (opt->sizes != NULL)
+    {
+        sizeCount = ParseIntList(opt->sizes, sizes);
+    }
+    else
+    {
+        sizes[0] = arraySize;
+        sizeCount = 1;
+    }
+    if (opt->threads != NULL && strcmp(opt->threads, "all") == 0)
+    {
+        for (threadCountCount = 0; threadCountCount < MAX_THREADS; threadCountCount++)
+        {
+            threads[threadCountCount] = threadCountCount + 1;
+        }
+    }
+    else if (opt->threads != NULL)
+    {
+        threadCountCount = ParseIntList(opt->threads, threads);
+    }
+    else
+    {
+        threads[0] = threadCount;
+        threadCountCount = 1;
+    }
+    if (opt->zeros != NULL)
+    {
+        snprintf(zeroList, sizeof(zeroList), "%s", opt->zeros);
+    }
+    else
+    {
+        snprintf(zeroList, sizeof(zeroList), "%d", indexForZero);
+    }
+    for (char *token = strtok_r(zeroList, ",", &save); token != NULL && zeroCount < MAX_SWEEP; token = strtok_r(NULL, ",", &save))
+    {
+        zeroTokens[zeroCount++] = token;
+    }
+    for (int i = 0; i < sizeCount; i++)
+    {
+        if (sizes[i] <= 0 || sizes[i] > MAX_SIZE)
+        {
+            fprintf(stderr, "Invalid Array Size %d\n", sizes[i]);
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < threadCountCount; i++)
+    {
+        if (threads[i] <= 0 || threads[i] > MAX_THREADS)
+        {
+            fprintf(stderr, "Invalid Thread Count %d\n", threads[i]);
+            exit(-1);
+        }
+    }
+    if (samples == NULL)
+    {
+        fprintf(stderr, "Out of memory for the benchmark samples\n");
+        exit(-1);
+    }
+    if (opt->outFile != NULL && (out = fopen(opt->outFile, "w")) == NULL)
+    {
+        perror("Cannot open the benchmark output file");
+        exit(-1);
+    }
+
+    if (strcmp(opt->format, "csv") == 0)
+    {
+        fprintf(out, "size,threads,zero_index,scheme,kernel,storage,modulus,warmup,reps,min_ns,median_ns,p99_ns,mean_ns,product\n");
+    }
+    else
+    {
+        fprintf(out, "[");
+    }
+
+    for (int si = 0; si < sizeCount; si++)
+    {
+        int size = sizes[si];
+
+        AllocData(size);
+        GenerateInput(size, -1);
+        if (opt->storage != STORAGE_INT32)
+        {
+            PackData(size, (opt->storage == STORAGE_AUTO) ? StorageForRange(size) : opt->storage, false);
+        }
+        for (int zi = 0; zi < zeroCount; zi++)
+        {
+            int zero = ZeroIndexFor(zeroTokens[zi], size);
+            int saved = 0;
+
+            if (zero >= size)
+            {
+                continue; // This position is beyond the end of this size
+            }
+            if (zero >= 0)
+            {
+                saved = GetElement(zero);
+                SetElement(zero, 0);
+            }
+            for (int ti = 0; ti < threadCountCount; ti++)
+            {
+                if (threads[ti] != gPool.size)
+                {
+                    PoolShutdown();
+                    gThreadCount = threads[ti];
+                    PoolInit(gThreadCount);
+                    if (opt->procs)
+                    {
+                        ProcPoolShutdown();
+                        ProcPoolInit(gThreadCount);
+                    }
+                }
+                CalculateIndices(size, gThreadCount, job.indices);
+
+                // Sequential scheme
+                uint32_t prod = 0;
+                for (int r = -opt->warmup; r < opt->reps; r++)
+                {
+                    SetTime();
+                    prod = SqFindProd(size);
+                    if (r >= 0)
+                    {
+                        samples[r] = GetTime();
+                    }
+                }
+                WriteBenchRow(out, opt, first, size, gThreadCount, zero, "sequential", samples, prod);
+                first = false;
+
+                // Threaded schemes
+                for (int s = 0; s < SCHEME_COUNT; s++)
+                {
+                    long elapsed;
+                    for (int r = -opt->warmup; r < opt->reps; r++)
+                    {
+                        prod = gSchemes[s].run(&job, &elapsed);
+                        if (r >= 0)
+                        {
+                            samples[r] = elapsed;
+                        }
+                    }
+                    WriteBenchRow(out, opt, false, size, gThreadCount, zero, gSchemes[s].name, samples, prod);
+                }
+                if (opt->procs)
+                {
+                    long elapsed;
+                    for (int r = -opt->warmup; r < opt->reps; r++)
+                    {
+                        prod = RunProcessScheme(&job, &elapsed);
+                        if (r >= 0)
+                        {
+                            samples[r] = elapsed;
+                        }
+                    }
+                    WriteBenchRow(out, opt, false, size, gThreadCount, zero, "processes", samples, prod);
+                }
+                fflush(out);
+            }
+            if (zero >= 0)
+            {
+                SetElement(zero, saved);
+            }
+        }
+        FreeData();
+    }
+
+    if (strcmp(opt->format, "json") == 0)
+    {
+        fprintf(out, "\n]\n");
+    }
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    free(samples);
+}
+
+static int CompareLong(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Sort the samples and write one result row. The p99 is the nearest-rank percentile,
+// so with fewer than 100 repetitions it is the maximum
+void WriteBenchRow(FILE *out, const Options *opt, bool first, int size, int threads, int zero, const char *scheme, long *samples, uint32_t prod)
+{
+    int n = opt->reps;
+    double mean = 0;
+
+    qsort(samples, n, sizeof(long), CompareLong);
+    for (int i = 0; i < n; i++)
+    {
+        mean += samples[i];
+    }
+    mean /= n;
+    long median = (n % 2) ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    long p99 = samples[(int)ceil(0.99 * n) - 1];
+
+    if (strcmp(opt->format, "csv") == 0)
+    {
+        fprintf(out, "%d,%d,%d,%s,%s,%s,%u,%d,%d,%ld,%ld,%ld,%.0f,%u\n", size, threads, zero, scheme, gProdKernelName,
+                gStorageNames[gStorage], gMod.value, opt->warmup, n, samples[0], median, p99, mean, prod);
+    }
+    else
+    {
+        fprintf(out, "%s\n  {\"size\": %d, \"threads\": %d, \"zero_index\": %d, \"scheme\": \"%s\", \"kernel\": \"%s\", "
+                     "\"storage\": \"%s\", \"modulus\": %u, \"warmup\": %d, \"reps\": %d, \"min_ns\": %ld, \"median_ns\": %ld, \"p99_ns\": %ld, "
+                     "\"mean_ns\": %.0f, \"product\": %u}",
+                first ? "" : ",", size, threads, zero, scheme, gProdKernelName, gStorageNames[gStorage], gMod.value, opt->warmup, n, samples[0],
+                median, p99, mean, prod);
+    }
+}
+
+// Parse a comma-separated list of at most MAX_SWEEP integers
+int ParseIntList(const char *list, int *values)
+{
+    int count = 0;
+    const char *p = list;
+
+    while (*p != '\0' && count < MAX_SWEEP)
+    {
+        char *end;
+        values[count++] = (int)strtol(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0'))
+        {
+            fprintf(stderr, "Invalid list %s\n", list);
+            exit(-1);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+// Zero position for one array size: -1 for none, an index, or a percentage of the size
+// ("100%" is the last element)
+int ZeroIndexFor(const char *token, int size)
+{
+    char *end;
+    double value = strtod(token, &end);
+
+    if (*end == '%')
+    {
+        long index = (long)(value / 100.0 * size);
+        return (int)((index >= size) ? size - 1 : index);
+    }
+    return (value < -1) ? -1 : (int)value;
+}
+
+static long MedianOf(long *samples, int n)
+{
+    qsort(samples, n, sizeof(long), CompareLong);
+    return samples[n / 2];
+}
+
+static int AllowedCpus(void)
+{
+    cpu_set_t allowed;
+    return (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) ? CPU_COUNT(&allowed) : 1;
+}
+
+// Use the calibration in path if it was measured with the same kernel, modulus and CPU
+// count, otherwise calibrate and (re)write it. The file is plain text:
+//   kernel <name> modulus <m> cpus <n>
+//   sequential <ns per element>
+//   threads <t> <ns per element> <scheme> <overhead ns> ...
+void LoadOrCalibrate(const char *path, bool retune)
+{
+    char defaultPath[PATH_MAX], line[1024], kernel[32];
+    unsigned modulus;
+    int cpus, lines = 0;
+    FILE *f;
+
+    if (path == NULL)
+    {
+        const char *home = getenv("HOME");
+        snprintf(defaultPath, sizeof(defaultPath), "%s/.MTFindProd.tune", home != NULL ? home : ".");
+        path = defaultPath;
+    }
+
+    memset(&gTune, 0, sizeof(gTune));
+    if (!retune && (f = fopen(path, "r")) != NULL)
+    {
+        if (fgets(line, sizeof(line), f) != NULL && sscanf(line, "kernel %31s modulus %u cpus %d", kernel, &modulus, &cpus) == 3 &&
+            strcmp(kernel, gProdKernelName) == 0 && modulus == gMod.value && cpus == AllowedCpus())
+        {
+            snprintf(gTune.kernel, sizeof(gTune.kernel), "%s", kernel);
+            gTune.modulus = modulus;
+            gTune.cpus = cpus;
+            while (fgets(line, sizeof(line), f) != NULL)
+            {
+                char *p = line, *end;
+                int t;
+
+                if (sscanf(line, "sequential %lf", &gTune.seqNs) == 1)
+                {
+                    lines++;
+                    continue;
+                }
+                if (strncmp(line, "threads ", 8) != 0 || (t = (int)strtol(line + 8, &p, 10)) < 1 || t > MAX_THREADS)
+                {
+                    continue;
+                }
+                gTune.elementNs[t] = strtod(p, &p);
+                for (int s = 0; s < SCHEME_COUNT; s++)
+                {
+                    char name[32];
+                    int used;
+                    double overhead;
+                    if (sscanf(p, " %31s %lf%n", name, &overhead, &used) != 2)
+                    {
+                        break;
+                    }
+                    p += used;
+                    for (int k = 0; k < SCHEME_COUNT; k++)
+                    {
+                        if (strcmp(name, gSchemes[k].name) == 0)
+                        {
+                            gTune.overheadNs[t][k] = overhead;
+                        }
+                    }
+                }
+                (void)end;
+                gTune.maxThreads = (t > gTune.maxThreads) ? t : gTune.maxThreads;
+                lines++;
+            }
+        }
+        fclose(f);
+        if (gTune.seqNs > 0 && lines == gTune.maxThreads + 1)
+        {
+            return;
+        }
+    }
+
+    printf("Calibrating this machine for the auto-tuning...\n");
+    Calibrate();
+    if ((f = fopen(path, "w")) == NULL)
+    {
+        perror("Cannot write the calibration cache"); // Still usable for this run
+        return;
+    }
+    fprintf(f, "kernel %s modulus %u cpus %d\n", gTune.kernel, gTune.modulus, gTune.cpus);
+    fprintf(f, "sequential %.6f\n", gTune.seqNs);
+    for (int t = 1; t <= gTune.maxThreads; t++)
+    {
+        fprintf(f, "threads %d %.6f", t, gTune.elementNs[t]);
+        for (int s = 0; s < SCHEME_COUNT; s++)
+        {
+            fprintf(f, " %s %.0f", gSchemes[s].name, gTune.overheadNs[t][s]);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    printf("Calibration written to %s\n", path);
+}
+
+// For every thread count up to the number of CPUs: the median time of each scheme on
+// TUNE_SMALL elements per worker is its dispatch overhead, and the median time of the
+// join scheme on TUNE_SIZE elements, less its overhead, gives the per-element time.
+// Runs before main() starts its own pool and leaves none running
+void Calibrate(void)
+{
+    long samples[TUNE_REPS];
+    Job job;
+
+    snprintf(gTune.kernel, sizeof(gTune.kernel), "%s", gProdKernelName);
+    gTune.modulus = gMod.value;
+    gTune.cpus = AllowedCpus();
+    gTune.maxThreads = (gTune.cpus < MAX_THREADS) ? gTune.cpus : MAX_THREADS;
+
+    gThreadCount = gTune.maxThreads;
+    PoolInit(gThreadCount);
+    AllocData(TUNE_SIZE);
+    GenerateInput(TUNE_SIZE, -1);
+    for (int i = 0; i < TUNE_SIZE; i++)
+    {
+        if (gData[i] % gMod.value == 0)
+        {
+            gData[i] = 1; // A product that becomes zero would stop the kernels early
+        }
+    }
+    for (int r = 0; r < TUNE_REPS; r++)
+    {
+        SetTime();
+        SqFindProd(TUNE_SIZE);
+        samples[r] = GetTime();
+    }
+    gTune.seqNs = (double)MedianOf(samples, TUNE_REPS) / TUNE_SIZE;
+
+    for (int t = 1; t <= gTune.maxThreads; t++)
+    {
+        if (t != gPool.size)
+        {
+            PoolShutdown();
+            gThreadCount = t;
+            PoolInit(t);
+        }
+        CalculateIndices(t * TUNE_SMALL, t, job.indices);
+        for (int s = 0; s < SCHEME_COUNT; s++)
+        {
+            for (int r = 0; r < TUNE_REPS; r++)
+            {
+                gSchemes[s].run(&job, &samples[r]);
+            }
+            gTune.overheadNs[t][s] = MedianOf(samples, TUNE_REPS);
+        }
+        CalculateIndices(TUNE_SIZE, t, job.indices);
+        for (int r = 0; r < TUNE_REPS; r++)
+        {
+            gSchemes[0].run(&job, &samples[r]);
+        }
+        double work = MedianOf(samples, TUNE_REPS) - gTune.overheadNs[t][0];
+        gTune.elementNs[t] = (work > 0 ? work : 0) / TUNE_SIZE;
+    }
+    PoolShutdown();
+    FreeData();
+}
+
+// The fastest way to multiply n elements according to gTune: TUNE_SEQUENTIAL or a scheme
+// index, with its thread count (1 for sequential) and predicted time. With onlyScheme >= 0
+// only that scheme is considered, at its best thread count
+int TunePick(long long n, int onlyScheme, int *threads, double *predictedNs)
+{
+    int best = TUNE_SEQUENTIAL;
+
+    *threads = 1;
+    *predictedNs = (onlyScheme >= 0) ? 1e300 : gTune.seqNs * n;
+    for (int t = 1; t <= gTune.maxThreads; t++)
+    {
+        for (int s = 0; s < SCHEME_COUNT; s++)
+        {
+            double predicted = gTune.overheadNs[t][s] + gTune.elementNs[t] * n;
+            if ((onlyScheme < 0 || s == onlyScheme) && predicted < *predictedNs)
+            {
+                best = s;
+                *threads = t;
+                *predictedNs = predicted;
+            }
+        }
+    }
+    return best;
+}
+
+// Time SLOT_BENCH_UPDATES result publications per worker in each slot layout, doubling
+// the worker count from 1 up to maxThreads. With the packed arrays every store of one
+// worker invalidates the line the others are writing, so the time per update grows with
+// the worker count; with padded slots it stays flat
+void RunSlotBenchmark(int maxThreads)
+{
+    static const struct
+    {
+        const char *name;
+        void *(*routine)(void *);
+    } layouts[] = {
+        {"packed, under lock", ThSlotBenchLocked},
+        {"packed, atomic stores", ThSlotBenchPacked},
+        {"padded slots, release stores", ThSlotBenchPadded},
+    };
+    Job job = {0}; // The routines ignore the divisions
+
+    printf("%-8s", "threads");
+    for (int l = 0; l < 3; l++)
+    {
+        printf(" %30s", layouts[l].name);
+    }
+    printf("\n");
+    for (int threads = 1; threads <= maxThreads; threads = (threads * 2 > maxThreads && threads < maxThreads) ? maxThreads : threads * 2)
+    {
+        if (threads != gPool.size)
+        {
+            PoolShutdown();
+            gThreadCount = threads;
+            PoolInit(threads);
+        }
+        printf("%-8d", threads);
+        for (int l = 0; l < 3; l++)
+        {
+            job.routine = layouts[l].routine;
+            SetTime();
+            PoolSubmit(&job);
+            PoolJoin();
+            printf(" %24.2f ns/op", (double)GetTime() / SLOT_BENCH_UPDATES);
+        }
+        printf("\n");
+    }
+}
+
+void *ThSlotBenchLocked(void *param)
+{
+    int id = ((ThreadData *)param)->id;
+    for (uint32_t k = 0; k < SLOT_BENCH_UPDATES; k++)
+    {
+        pthread_mutex_lock(&lock);
+        gPackedProd[id] = k;
+        gPackedDone[id] = true;
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+void *ThSlotBenchPacked(void *param)
+{
+    int id = ((ThreadData *)param)->id;
+    for (uint32_t k = 0; k < SLOT_BENCH_UPDATES; k++)
+    {
+        atomic_store_explicit(&gPackedAtomicProd[id], k, memory_order_release);
+        atomic_store_explicit(&gPackedAtomicDone[id], true, memory_order_release);
+    }
+    return NULL;
+}
+
+void *ThSlotBenchPadded(void *param)
+{
+    int id = ((ThreadData *)param)->id;
+    for (uint32_t k = 0; k < SLOT_BENCH_UPDATES; k++)
+    {
+        PublishResult(id, k);
+    }
+    return NULL;
+}
+
+// Run the job on the pool and wait for every worker to finish it
+// The time from submitting the job to having the product is returned in elapsed
+uint32_t RunJoinScheme(Job *job, long *elapsed)
+{
+    uint32_t prod;
+
+    InitSharedVars();
+    job->routine = ThFindProd;
+
+    SetTime();
+    BeginWait();
+    PoolSubmit(job);
+    PoolJoin();
+    EndWait();
+    prod = ComputeTotalProduct();
+    *elapsed = GetTime();
+
+    return prod;
+}
+
+// Run the job on the pool while the parent keeps checking whether all workers are
+// done or one of them found a zero. Workers that are still running after a zero was
+// found notice found_zero and return on their own, so nothing has to be cancelled
+uint32_t RunBusyCheckScheme(Job *job, long *elapsed)
+{
+    uint32_t prod;
+
+    InitSharedVars();
+    job->routine = ThFindProd;
+
+    SetTime();
+    BeginWait();
+    PoolSubmit(job);
+
+    // Busy-wait loop. The done flags are read without a lock; each sits in its own
+    // cache line, which the parent only pulls back after that worker wrote it
+    while (1)
+    {
+        int doneCount = 0;
+        for (int i = 0; i < gThreadCount; i++)
+        {
+            doneCount += atomic_load_explicit(&gThreadSlots[i].done, memory_order_acquire);
+        }
+
+        if (doneCount >= gThreadCount || atomic_load(&found_zero))
+            break;
+
+        sched_yield(); // Yield CPU to avoid hogging resources
+    }
+    EndWait();
+
+    prod = atomic_load(&found_zero) ? 0 : ComputeTotalProduct();
+    *elapsed = GetTime();
+
+    // Let the remaining workers drain before the next scheme, outside the timed region
+    PoolJoin();
+    return prod;
+}
+
+// Run the job while the parent blocks on the "completed" semaphore, which the last worker
+// to finish (or the first one to find a zero) posts
+uint32_t RunSemaphoreScheme(Job *job, long *elapsed)
+{
+    uint32_t prod;
+
+    InitSharedVars();
+    sem_init(&completed, 0, 0);
+    sem_init(&mutex, 0, 1);
+    job->routine = ThFindProdWithSemaphore;
+
+    SetTime();
+    BeginWait();
+    PoolSubmit(job);
+    sem_wait(&completed);
+    EndWait();
+    prod = atomic_load(&found_zero) ? 0 : ComputeTotalProduct();
+    *elapsed = GetTime();
+
+    PoolJoin();
+    sem_destroy(&mutex);
+    sem_destroy(&completed);
+    return prod;
+}
+
+// Run the job while the parent sleeps in FUTEX_WAIT on gDoneWord. Workers count
+// themselves done with an atomic increment and only enter the kernel to wake the parent
+// when they complete the count or find a zero
+uint32_t RunFutexScheme(Job *job, long *elapsed)
+{
+    uint32_t prod;
+    unsigned word;
+
+    InitSharedVars();
+    atomic_store(&gDoneWord, 0);
+    job->routine = ThFindProdWithFutex;
+
+    SetTime();
+    BeginWait();
+    PoolSubmit(job);
+    while ((word = atomic_load(&gDoneWord)) < (unsigned)gThreadCount)
+    {
+        // Returns right away if gDoneWord no longer holds word
+        syscall(SYS_futex, &gDoneWord, FUTEX_WAIT_PRIVATE, word, NULL, NULL, 0);
+    }
+    EndWait();
+    prod = (word & DONE_WORD_ZERO) ? 0 : ComputeTotalProduct();
+    *elapsed = GetTime();
+
+    PoolJoin();
+    return prod;
+}
+
+// Run the job while the parent blocks in read() on an eventfd that the last worker to
+// finish (or the first one to find a zero) writes to
+uint32_t RunEventfdScheme(Job *job, long *elapsed)
+{
+    uint32_t prod;
+    uint64_t value;
+    ssize_t got;
+
+    InitSharedVars();
+    gDoneEventFd = eventfd(0, EFD_CLOEXEC);
+    if (gDoneEventFd == -1)
+    {
+        perror("eventfd failed");
+        exit(-1);
+    }
+    atomic_store(&gDoneWord, 0);
+    job->routine = ThFindProdWithEventfd;
+
+    SetTime();
+    BeginWait();
+    PoolSubmit(job);
+    while ((got = read(gDoneEventFd, &value, sizeof(value))) != sizeof(value))
+    {
+        if (got != -1 || errno != EINTR)
+        {
+            perror("eventfd read failed"); // An eventfd read is all or nothing
+            exit(-1);
+        }
+    }
+    EndWait();
+    prod = atomic_load(&found_zero) ? 0 : ComputeTotalProduct();
+    *elapsed = GetTime();
+
+    PoolJoin();
+    close(gDoneEventFd);
+    gDoneEventFd = -1;
+    return prod;
+}
+
+// Run the job while the parent waits on a condition variable, like a barrier the
+// parent waits at until every worker arrived (or one found a zero)
+uint32_t RunCondvarScheme(Job *job, long *elapsed)
+{
+    uint32_t prod;
+
+    InitSharedVars();
+    pthread_mutex_init(&gDoneLock, NULL);
+    pthread_cond_init(&gDoneCond, NULL);
+    gDoneCount = 0;
+    job->routine = ThFindProdWithCondvar;
+
+    SetTime();
+    BeginWait();
+    PoolSubmit(job);
+    pthread_mutex_lock(&gDoneLock);
+    while (gDoneCount < gThreadCount && !atomic_load(&found_zero))
+    {
+        pthread_cond_wait(&gDoneCond, &gDoneLock);
+    }
+    pthread_mutex_unlock(&gDoneLock);
+    EndWait();
+    prod = atomic_load(&found_zero) ? 0 : ComputeTotalProduct();
+    *elapsed = GetTime();
+
+    PoolJoin();
+    pthread_cond_destroy(&gDoneCond);
+    pthread_mutex_destroy(&gDoneLock);
+    return prod;
+}
+
+// Start measuring the parent's side of a threaded scheme
+void BeginWait(void)
+{
+    atomic_store(&gNotifyNs, 0);
+    gParentCpuNs = ThreadCpuNs();
+    PerfStart(PERF_PARENT);
+}
+
+// The parent has the product: record the CPU time it used since BeginWait() and how
+// long ago the last worker notified it
+void EndWait(void)
+{
+    long long now = NowNs();
+    long long notified = atomic_load(&gNotifyNs);
+
+    PerfStop(PERF_PARENT);
+    gParentCpuNs = ThreadCpuNs() - gParentCpuNs;
+    gWakeLatencyNs = (notified > 0 && notified <= now) ? now - notified : 0;
+}
+
+// Run the job with the work-stealing scheduler and wait for every worker to finish
+// Each worker folds the products of all tasks it ran into its gThreadSlots slot, so the
+// slots are combined by ComputeTotalProduct exactly as for the static division
+uint32_t RunStealingScheme(Job *job, long *elapsed)
+{
+    uint32_t prod;
+
+    InitSharedVars();
+    InitStealTasks(job);
+    job->routine = ThFindProdStealing;
+
+    SetTime();
+    BeginWait();
+    PoolSubmit(job);
+    PoolJoin();
+    EndWait();
+    prod = ComputeTotalProduct();
+    *elapsed = GetTime();
+
+    return prod;
+}
+
+uint32_t RunFusedScheme(Job *job, long *elapsed)
+{
+    uint32_t prod;
+
+    InitSharedVars();
+    job->routine = ThFindProdFused;
+
+    SetTime();
+    BeginWait();
+    PoolSubmit(job);
+    PoolJoin();
+    EndWait();
+    prod = ComputeTotalProduct();
+    *elapsed = GetTime();
+
+    return prod;
+}
+
+// Wait on a futex word of the process header while it holds value. A worker process that
+// died would never report, so the wait times out now and then to check on them
+static void ProcWait(atomic_uint *word, unsigned value)
+{
+    struct timespec timeout = {1, 0};
+
+    if (syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0) == -1 && errno == ETIMEDOUT)
+    {
+        for (int i = 0; i < gProcs.size; i++)
+        {
+            if (waitpid(gProcs.pid[i], NULL, WNOHANG) != 0)
+            {
+                fprintf(stderr, "Worker process %d exited\n", i);
+                exit(-1);
+            }
+        }
+    }
+}
+
+// Post the job in the process header. Returns once every worker is done or one found a zero
+static unsigned ProcPost(void)
+{
+    ProcHeader *h = gProcs.header;
+    unsigned word;
+
+    atomic_fetch_add(&h->jobSeq, 1);
+    syscall(SYS_futex, &h->jobSeq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    while (!((word = atomic_load(&h->doneWord)) & DONE_WORD_ZERO) && word < (unsigned)gProcs.size)
+    {
+        ProcWait(&h->doneWord, word);
+    }
+    return word;
+}
+
+// Wait until every worker is done with the posted job, and reset the header for the next
+static void ProcDrain(void)
+{
+    unsigned word;
+
+    while (((word = atomic_load(&gProcs.header->doneWord)) & ~DONE_WORD_ZERO) < (unsigned)gProcs.size)
+    {
+        ProcWait(&gProcs.header->doneWord, word);
+    }
+    ProcReset();
+}
+
+// Same divisions as the threaded schemes, multiplied by the worker processes. Mapping a
+// new gData segment in the workers is done by an empty job first, untimed like the
+// creation of the pool threads; the cancelled workers are drained after the timing, as
+// PoolJoin does in the futex scheme
+uint32_t RunProcessScheme(Job *job, long *elapsed)
+{
+    ProcHeader *h = gProcs.header;
+    uint32_t prod = 1;
+    unsigned word;
+
+    if (gProcs.size != gThreadCount)
+    {
+        fprintf(stderr, "The process pool has %d workers for %d divisions\n", gProcs.size, gThreadCount);
+        exit(-1);
+    }
+    if (h->dataGen != gShmDataGen)
+    {
+        h->dataGen = gShmDataGen;
+        h->dataBytes = gDataBytes;
+        memcpy(h->dataName, gShmDataName, sizeof(h->dataName));
+        for (int i = 0; i < gProcs.size; i++)
+        {
+            h->indices[i][1] = 0;
+            h->indices[i][2] = -1;
+        }
+        ProcPost();
+        ProcDrain();
+    }
+    memcpy(h->indices, job->indices, sizeof(h->indices));
+
+    SetTime();
+    word = ProcPost();
+    if (word & DONE_WORD_ZERO)
+    {
+        prod = 0;
+    }
+    else
+    {
+        for (int i = 0; i < gProcs.size; i++)
+        {
+            prod = ModMul(prod, atomic_load_explicit(&h->slots[i].prod, memory_order_acquire), gMod);
+        }
+    }
+    *elapsed = GetTime();
+
+    ProcDrain();
+    return prod;
+}
+
+void RunFusedEngines(Job *job, int size)
+{
+    uint32_t prod;
+    long elapsed;
+
+    PerfReset();
+    SetTime();
+    PerfStart(PERF_PARENT);
+    prod = SqFindProdFused(size);
+    PerfStop(PERF_PARENT);
+    elapsed = GetTime();
+    printf("Sequential fused generation and multiplication completed in %.3f ms. Product = %u\n", elapsed / 1e6, prod);
+    if (gPerf)
+    {
+        PrintPerfCounters(false);
+    }
+
+    PerfReset();
+    prod = RunFusedScheme(job, &elapsed);
+    printf("Threaded fused generation and multiplication completed in %.3f ms. Product = %u\n", elapsed / 1e6, prod);
+    if (gPerf)
+    {
+        PrintPerfCounters(true);
+    }
+}
+
+// Multiply an input file that does not fit in memory: the reader thread reads chunk N+1
+// while the pool multiplies chunk N with the join scheme, and the chunk products are
+// combined the same way ComputeTotalProduct combines the division products
+uint32_t RunStreamingScheme(Job *job, const char *path, long long count, long long indexForZero, int chunk, long *elapsed)
+{
+    StreamState state;
+    pthread_t reader;
+    uint32_t prod = 1;
+    long start, chunkElapsed;
+
+    state.fd = open(path, O_RDONLY);
+    if (state.fd == -1)
+    {
+        perror("open failed");
+        exit(-1);
+    }
+    posix_fadvise(state.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    state.count = count;
+    state.zeroIndex = indexForZero;
+    state.chunk = chunk;
+    for (int b = 0; b < 2; b++)
+    {
+        state.buf[b] = aligned_alloc(64, ((size_t)chunk * sizeof(int) + 63) & ~(size_t)63);
+        if (state.buf[b] == NULL)
+        {
+            fprintf(stderr, "Out of memory for the stream buffers\n");
+            exit(-1);
+        }
+    }
+    sem_init(&state.empty, 0, 2);
+    sem_init(&state.full, 0, 0);
+    atomic_init(&state.stop, false);
+
+    start = GetCurrentTime(); // RunJoinScheme uses SetTime/GetTime for each chunk
+    pthread_create(&reader, NULL, StreamReader, &state);
+    for (int k = 0;; k++)
+    {
+        int b = k % 2;
+        sem_wait(&state.full);
+        if (state.len[b] == 0)
+        {
+            break;
+        }
+
+        gData = state.buf[b];
+        CalculateIndices(state.len[b], gThreadCount, job->indices);
+        prod = ModMul(prod, RunJoinScheme(job, &chunkElapsed), gMod);
+        if (prod == 0)
+        {
+            // The rest of the file cannot change the product
+            atomic_store(&state.stop, true);
+            sem_post(&state.empty);
+            break;
+        }
+        sem_post(&state.empty);
+    }
+    pthread_join(reader, NULL);
+    *elapsed = GetCurrentTime() - start;
+
+    gData = NULL;
+    sem_destroy(&state.full);
+    sem_destroy(&state.empty);
+    free(state.buf[0]);
+    free(state.buf[1]);
+    close(state.fd);
+    return prod;
+}
+
+// Reader thread of the streaming scheme: fill the buffers in turn until count elements
+// have been read, then hand over an empty buffer to mark the end of the input
+void *StreamReader(void *param)
+{
+    StreamState *state = (StreamState *)param;
+    long long offset = 0;
+
+    for (int k = 0;; k++)
+    {
+        int b = k % 2;
+        sem_wait(&state->empty);
+        if (atomic_load(&state->stop))
+        {
+            break;
+        }
+
+        long long left = state->count - offset;
+        int n = (left < state->chunk) ? (int)left : state->chunk;
+        size_t want = (size_t)n * sizeof(int), got = 0;
+        while (got < want)
+        {
+            ssize_t r = read(state->fd, (char *)state->buf[b] + got, want - got);
+            if (r <= 0)
+            {
+                fprintf(stderr, "Input file ended after %lld elements\n", offset + (long long)(got / sizeof(int)));
+                exit(-1);
+            }
+            got += r;
+        }
+        unsigned top = 0; // Negative elements wrap around to large ones
+        for (int i = 0; i < n; i++)
+        {
+            top = ((unsigned)state->buf[b][i] > top) ? (unsigned)state->buf[b][i] : top;
+        }
+        if (top > MAX_RANDOM_NUMBER)
+        {
+            fprintf(stderr, "Input file holds elements outside [0, %d] among elements %lld to %lld\n", MAX_RANDOM_NUMBER, offset, offset + n - 1);
+            exit(-1);
+        }
+        if (state->zeroIndex >= offset && state->zeroIndex < offset + n)
+        {
+            state->buf[b][state->zeroIndex - offset] = 0;
+        }
+        offset += n;
+        state->len[b] = n;
+        sem_post(&state->full);
+        if (n == 0)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Write a regular sequential function to multiply all the elements in gData mod NUM_LIMIT
+// REMEMBER TO MOD BY NUM_LIMIT AFTER EACH MULTIPLICATION TO PREVENT YOUR PRODUCT VARIABLE FROM OVERFLOWING
+uint32_t SqFindProd(int size)
+{
+    if (gStorage == STORAGE_INT32)
+    {
+        return ScanAndMultiply(gData, size);
+    }
+    if (gZeroScan && FindZeroRange(0, size) >= 0)
+    {
+        return 0;
+    }
+    return ProdRange(0, size);
+}
+
+// Zero fast path: a zero anywhere makes the product zero, and finding it only takes a
+// compare per element, so with -zeroscan the array is scanned for one before multiplying
+// The scan is an extra pass over memory, which is why it is not on by default: with the
+// SIMD kernels close to memory bandwidth it only pays off when a zero is likely
+uint32_t ScanAndMultiply(const int *data, int n)
+{
+    if (gZeroScan && gFindZero(data, n) >= 0)
+    {
+        return 0;
+    }
+    return gProdKernel(data, n);
+}
+
+// Product of n elements from first with the kernel of the current layout. The schemes
+// call this once per block, so the layout test costs nothing next to the block
+uint32_t ProdRange(long first, int n)
+{
+    if (gStorage == STORAGE_INT32)
+    {
+        return gProdKernel(gData + first, n);
+    }
+    return gPackedKernel(gPacked, first, n);
+}
+
+// Zero scan of n elements from first in the current layout
+int FindZeroRange(long first, int n)
+{
+    if (gStorage == STORAGE_INT32)
+    {
+        return gFindZero(gData + first, n);
+    }
+    if (gStorage == STORAGE_UINT16)
+    {
+        const uint16_t *data = (const uint16_t *)gPacked + first;
+        for (int i = 0; i < n; i++)
+        {
+            if (data[i] == 0)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (PackedElement(gPacked, first + i, 12) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Compute part of every thread function: the product of the worker's division mod gMod
+// With -zeroscan the division is first scanned for a zero. It is multiplied PROD_BLOCK
+// elements at a time; a zero (or a block whose product is zero) makes the whole product
+// zero, which is what found_zero reports. Workers check found_zero between blocks and
+// simply return, so a zero found early in any division stops every worker within one block
+DivisionResult MultiplyDivision(ThreadData *data, uint32_t *product)
+{
+    DivisionResult scan = ScanForZero(data);
+
+    *product = (scan == DIVISION_ZERO) ? 0 : 1;
+    if (scan != DIVISION_DONE)
+    {
+        return scan;
+    }
+    for (int i = data->start; i <= data->end; i += PROD_BLOCK)
+    {
+        // Check if another thread found a zero (atomic load)
+        if (atomic_load(&found_zero))
+        {
+            return DIVISION_CANCELLED;
+        }
+
+        int n = (data->end - i + 1 < PROD_BLOCK) ? (data->end - i + 1) : PROD_BLOCK;
+        uint32_t blockProd = ProdRange(i, n);
+        if (blockProd == 0)
+        {
+            // Set found_zero atomically
+            atomic_store(&found_zero, true);
+            *product = 0;
+            return DIVISION_ZERO;
+        }
+        *product = ModMul(*product, blockProd, gMod);
+    }
+    return DIVISION_DONE;
+}
+
+// Write a thread function that computes the product of all the elements in one division of the array mod NUM_LIMIT
+// REMEMBER TO MOD BY NUM_LIMIT AFTER EACH MULTIPLICATION TO PREVENT YOUR PRODUCT VARIABLE FROM OVERFLOWING
+// When it is done, this function stores the product in its slot of gThreadSlots and marks the slot done
+void *ThFindProd(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    uint32_t product;
+    DivisionResult result = MultiplyDivision(data, &product);
+
+    if (result == DIVISION_CANCELLED)
+    {
+        return NULL;
+    }
+    atomic_store(&gNotifyNs, NowNs());
+    PublishResult(data->id, product); // Zero if this division holds a zero
+    return NULL;
+}
+
+// Release stores: whoever sees done set (or reads prod with acquire) also sees the product
+void PublishResult(int id, uint32_t product)
+{
+    atomic_store_explicit(&gThreadSlots[id].prod, product, memory_order_release);
+    atomic_store_explicit(&gThreadSlots[id].done, true, memory_order_release);
+}
+
+// Write a thread function that computes the product of all the elements in one division of the array mod NUM_LIMIT
+// REMEMBER TO MOD BY NUM_LIMIT AFTER EACH MULTIPLICATION TO PREVENT YOUR PRODUCT VARIABLE FROM OVERFLOWING
+// When it is done, this function should store the product in its slot of gThreadSlots
+// If the product value in this division is zero, this function should post the "completed" semaphore
+// If the product value in this division is not zero, this function should increment gDoneThreadCount and
+// post the "completed" semaphore if it is the last thread to be done
+// Don't forget to protect access to gDoneThreadCount with the "mutex" semaphore
+void *ThFindProdWithSemaphore(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    uint32_t product;
+    DivisionResult result = MultiplyDivision(data, &product);
+
+    if (result == DIVISION_CANCELLED)
+    {
+        return NULL;
+    }
+    PublishResult(data->id, product); // Zero if this division holds a zero
+    sem_wait(&mutex);
+    if (result == DIVISION_ZERO || ++gDoneThreadCount == gThreadCount)
+    {
+        atomic_store(&gNotifyNs, NowNs());
+        sem_post(&completed); // Notify parent if all threads done or a zero was found
+    }
+    sem_post(&mutex);
+
+    return NULL;
+}
+
+// Like ThFindProdWithSemaphore, but the done count is an atomic futex word: no lock is
+// taken, and the kernel is only entered for the one wake-up the parent needs
+void *ThFindProdWithFutex(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    uint32_t product;
+    DivisionResult result = MultiplyDivision(data, &product);
+    unsigned before;
+
+    if (result == DIVISION_CANCELLED)
+    {
+        return NULL;
+    }
+    PublishResult(data->id, product);
+    if (result == DIVISION_ZERO)
+    {
+        before = atomic_fetch_or(&gDoneWord, DONE_WORD_ZERO);
+    }
+    else
+    {
+        before = atomic_fetch_add(&gDoneWord, 1);
+        if (before + 1 != (unsigned)gThreadCount)
+        {
+            return NULL;
+        }
+    }
+    if (!(before & DONE_WORD_ZERO))
+    {
+        atomic_store(&gNotifyNs, NowNs());
+        syscall(SYS_futex, &gDoneWord, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    return NULL;
+}
+
+// Like ThFindProdWithFutex, but the wake-up is a write to gDoneEventFd
+void *ThFindProdWithEventfd(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    uint32_t product;
+    DivisionResult result = MultiplyDivision(data, &product);
+    uint64_t one = 1;
+    unsigned before;
+
+    if (result == DIVISION_CANCELLED)
+    {
+        return NULL;
+    }
+    PublishResult(data->id, product);
+    if (result == DIVISION_ZERO)
+    {
+        before = atomic_fetch_or(&gDoneWord, DONE_WORD_ZERO);
+    }
+    else
+    {
+        before = atomic_fetch_add(&gDoneWord, 1);
+        if (before + 1 != (unsigned)gThreadCount)
+        {
+            return NULL;
+        }
+    }
+    if (!(before & DONE_WORD_ZERO))
+    {
+        atomic_store(&gNotifyNs, NowNs());
+        if (write(gDoneEventFd, &one, sizeof(one)) != sizeof(one))
+        {
+            perror("eventfd write failed");
+        }
+    }
+    return NULL;
+}
+
+// Like ThFindProdWithSemaphore, with a mutex-protected count and a condition variable
+void *ThFindProdWithCondvar(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    uint32_t product;
+    DivisionResult result = MultiplyDivision(data, &product);
+
+    if (result == DIVISION_CANCELLED)
+    {
+        return NULL;
+    }
+    PublishResult(data->id, product);
+    pthread_mutex_lock(&gDoneLock);
+    if (result == DIVISION_ZERO || ++gDoneCount == gThreadCount)
+    {
+        atomic_store(&gNotifyNs, NowNs());
+        pthread_cond_signal(&gDoneCond);
+    }
+    pthread_mutex_unlock(&gDoneLock);
+    return NULL;
+}
+
+// Thread function of the work-stealing scheme: run the tasks of this worker's own deque,
+// then steal from the other workers until every deque is empty or a zero was found
+void *ThFindProdStealing(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    uint32_t product = 1;
+    int victim = data->id;
+
+    while (!atomic_load(&found_zero))
+    {
+        long t = DequeTake(&gDeques[data->id]);
+
+        // Own deque is empty: look for a victim, starting after the last successful one
+        for (int tries = 0; t == DEQUE_EMPTY && tries < gThreadCount; tries++)
+        {
+            victim = (victim + 1) % gThreadCount;
+            if (victim == data->id)
+            {
+                continue;
+            }
+            while ((t = DequeSteal(&gDeques[victim])) == DEQUE_ABORT)
+            {
+            }
+        }
+        if (t == DEQUE_EMPTY)
+        {
+            break; // No task anywhere, and none are ever added
+        }
+
+        const StealTask *task = &gStealTasks[t];
+        uint32_t taskProd = ProdRange(task->start, task->end - task->start + 1);
+        if (taskProd == 0)
+        {
+            atomic_store(&found_zero, true);
+            PublishResult(data->id, 0);
+            return NULL;
+        }
+        product = ModMul(product, taskProd, gMod);
+    }
+
+    atomic_store(&gNotifyNs, NowNs());
+    PublishResult(data->id, product);
+    return NULL;
+}
+
+// The elements GenerateInput would write at first to first + n - 1 (with gFusedZero as
+// the zero), generated into buf and multiplied while they are still in L1
+uint32_t FusedChunkProd(int first, int n, int *buf)
+{
+    for (int j = 0; j < n; j++)
+    {
+        buf[j] = GetCounterRand((uint64_t)first + j);
+    }
+    if (gFusedZero >= first && gFusedZero - first < n)
+    {
+        buf[gFusedZero - first] = 0;
+    }
+    return gProdKernel(buf, n);
+}
+
+uint32_t SqFindProdFused(int size)
+{
+    _Alignas(CACHE_LINE) int buf[FUSED_CHUNK];
+    uint32_t product = 1;
+
+    for (int i = 0; i < size; i += FUSED_CHUNK)
+    {
+        int n = (size - i < FUSED_CHUNK) ? size - i : FUSED_CHUNK;
+        uint32_t chunkProd = FusedChunkProd(i, n, buf);
+        if (chunkProd == 0)
+        {
+            return 0;
+        }
+        product = ModMul(product, chunkProd, gMod);
+    }
+    return product;
+}
+
+// Same as ThFindProd, with the division generated chunk by chunk into a buffer of its
+// own; found_zero is checked once per chunk
+void *ThFindProdFused(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    _Alignas(CACHE_LINE) int buf[FUSED_CHUNK];
+    uint32_t product = 1;
+
+    for (int i = data->start; i <= data->end; i += FUSED_CHUNK)
+    {
+        if (atomic_load(&found_zero))
+        {
+            return NULL;
+        }
+
+        int n = (data->end - i + 1 < FUSED_CHUNK) ? (data->end - i + 1) : FUSED_CHUNK;
+        uint32_t chunkProd = FusedChunkProd(i, n, buf);
+        if (chunkProd == 0)
+        {
+            atomic_store(&found_zero, true);
+            PublishResult(data->id, 0);
+            return NULL;
+        }
+        product = ModMul(product, chunkProd, gMod);
+    }
+
+    atomic_store(&gNotifyNs, NowNs());
+    PublishResult(data->id, product);
+    return NULL;
+}
+
+uint32_t ModPow(uint32_t base, uint64_t exp, Modulus m)
+{
+    uint32_t result = 1;
+    base = ModReduce(base, m);
+    for (; exp > 0; exp >>= 1)
+    {
+        if (exp & 1)
+        {
+            result = ModMul(result, base, m);
+        }
+        base = ModMul(base, base, m);
+    }
+    return result;
+}
+
+// Check that gMod is a prime p <= LOG_MAX_MODULUS, find the smallest primitive root g
+// (g^((p-1)/q) != 1 for every prime factor q of p-1), then walk the powers of g once to
+// find the log of every residue an element can have
+bool InitLogEngine(void)
+{
+    static uint32_t residueLog[MAX_RANDOM_NUMBER + 1];
+    uint32_t p = gMod.value, factors[32];
+    int factorCount = 0;
+
+    gLog.ready = false;
+    if (p > LOG_MAX_MODULUS || p < 3)
+    {
+        return false;
+    }
+    for (uint32_t d = 2; d * d <= p; d++)
+    {
+        if (p % d == 0)
+        {
+            return false;
+        }
+    }
+    uint32_t rest = p - 1;
+    for (uint32_t d = 2; d * d <= rest; d++)
+    {
+        if (rest % d == 0)
+        {
+            factors[factorCount++] = d;
+            while (rest % d == 0)
+            {
+                rest /= d;
+            }
+        }
+    }
+    if (rest > 1)
+    {
+        factors[factorCount++] = rest;
+    }
+    gLog.order = p - 1;
+    for (gLog.root = 2;; gLog.root++)
+    {
+        int f = 0;
+        while (f < factorCount && ModPow(gLog.root, gLog.order / factors[f], gMod) != 1)
+        {
+            f++;
+        }
+        if (f == factorCount)
+        {
+            break;
+        }
+    }
+
+    // Residues of 1..MAX_RANDOM_NUMBER are below min(p, MAX_RANDOM_NUMBER + 1)
+    uint32_t limit = (p <= MAX_RANDOM_NUMBER) ? p - 1 : MAX_RANDOM_NUMBER;
+    uint32_t found = 0, power = 1;
+    for (uint32_t k = 0; k < gLog.order && found < limit; k++)
+    {
+        if (power <= limit)
+        {
+            residueLog[power] = k;
+            found++;
+        }
+        power = ModMul(power, gLog.root, gMod);
+    }
+    for (int x = 0; x <= MAX_RANDOM_NUMBER; x++)
+    {
+        uint32_t r = (uint32_t)x % p;
+        gLog.table[x] = (r == 0) ? LOG_ZERO : residueLog[r];
+    }
+    gLog.sum = (CpuIsaLevel() >= 2) ? LogSumAvx2 : LogSumScalar;
+    gLog.ready = true;
+    return true;
+}
+
+uint64_t LogSumScalar(const int *data, int n)
+{
+    const uint64_t *table = gLog.table;
+    uint64_t acc[4] = {0, 0, 0, 0};
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        acc[0] += table[data[i]];
+        acc[1] += table[data[i + 1]];
+        acc[2] += table[data[i + 2]];
+        acc[3] += table[data[i + 3]];
+    }
+    for (; i < n; i++)
+    {
+        acc[0] += table[data[i]];
+    }
+    return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+__attribute__((target("avx2"))) uint64_t LogSumAvx2(const int *data, int n)
+{
+    const long long *table = (const long long *)gLog.table;
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    uint64_t lanes[4];
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i x0 = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i x1 = _mm_loadu_si128((const __m128i *)(data + i + 4));
+        acc0 = _mm256_add_epi64(acc0, _mm256_i32gather_epi64(table, x0, 8));
+        acc1 = _mm256_add_epi64(acc1, _mm256_i32gather_epi64(table, x1, 8));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + LogSumScalar(data + i, n - i);
+}
+
+// Like MultiplyDivision, PROD_BLOCK elements at a time with the same cancellation
+DivisionResult LogSumDivision(ThreadData *data, uint32_t *logSum)
+{
+    uint64_t sum = 0;
+
+    *logSum = 0;
+    for (int i = data->start; i <= data->end; i += PROD_BLOCK)
+    {
+        if (atomic_load(&found_zero))
+        {
+            return DIVISION_CANCELLED;
+        }
+
+        int n = (data->end - i + 1 < PROD_BLOCK) ? (data->end - i + 1) : PROD_BLOCK;
+        uint64_t blockSum = gLog.sum(gData + i, n);
+        if (blockSum >= LOG_ZERO)
+        {
+            atomic_store(&found_zero, true);
+            return DIVISION_ZERO;
+        }
+        sum = (sum + blockSum) % gLog.order;
+    }
+    *logSum = (uint32_t)sum;
+    return DIVISION_DONE;
+}
+
+// The table only covers 0..MAX_RANDOM_NUMBER, any other element would be looked up
+// past its end
+bool LogEngineFits(void)
+{
+    return gLog.ready && gDataInRange;
+}
+
+uint32_t SqFindProdLog(int size)
+{
+    ThreadData all = {0, 0, size - 1, 1};
+    uint32_t logSum;
+
+    if (!LogEngineFits())
+    {
+        return SqFindProd(size);
+    }
+    atomic_store(&found_zero, false);
+    return (LogSumDivision(&all, &logSum) == DIVISION_DONE) ? ModPow(gLog.root, logSum, gMod) : 0;
+}
+
+// Publishes the division's log sum (not a product) in its slot
+void *ThFindProdLog(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    uint32_t logSum;
+
+    if (LogSumDivision(data, &logSum) != DIVISION_CANCELLED)
+    {
+        PublishResult(data->id, logSum);
+    }
+    return NULL;
+}
+
+// Like RunJoinScheme, adding the workers' log sums instead of multiplying products
+uint32_t RunLogScheme(Job *job, long *elapsed)
+{
+    uint64_t logSum = 0;
+    uint32_t prod;
+
+    if (!LogEngineFits())
+    {
+        return RunJoinScheme(job, elapsed);
+    }
+    InitSharedVars();
+    job->routine = ThFindProdLog;
+
+    SetTime();
+    PoolSubmit(job);
+    PoolJoin();
+    if (atomic_load(&found_zero))
+    {
+        prod = 0;
+    }
+    else
+    {
+        for (int i = 0; i < gThreadCount; i++)
+        {
+            logSum += atomic_load_explicit(&gThreadSlots[i].prod, memory_order_acquire);
+        }
+        prod = ModPow(gLog.root, logSum % gLog.order, gMod);
+    }
+    *elapsed = GetTime();
+    return prod;
+}
+
+void HistogramCount(const int *data, int n, Histogram *h)
+{
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        h->count[0][data[i]]++;
+        h->count[1][data[i + 1]]++;
+        h->count[2][data[i + 2]]++;
+        h->count[3][data[i + 3]]++;
+    }
+    for (; i < n; i++)
+    {
+        h->count[0][data[i]]++;
+    }
+}
+
+// The exponent is at most the array size, so ModPow takes at most 31 squarings per value
+uint32_t HistogramProduct(int first, int last, int histograms)
+{
+    uint32_t prod = 1;
+
+    for (int v = first; v <= last; v++)
+    {
+        uint64_t count = 0;
+        for (int h = 0; h < histograms; h++)
+        {
+            count += (uint64_t)gHistograms[h].count[0][v] + gHistograms[h].count[1][v] + gHistograms[h].count[2][v] + gHistograms[h].count[3][v];
+        }
+        if (count > 0)
+        {
+            prod = ModMul(prod, ModPow(v, count, gMod), gMod);
+        }
+    }
+    return prod;
+}
+
+// Count PROD_BLOCK elements at a time, stopping like MultiplyDivision once a zero turns up
+DivisionResult HistogramDivision(ThreadData *data)
+{
+    Histogram *h = &gHistograms[data->id];
+
+    memset(h, 0, sizeof(Histogram));
+    for (int i = data->start; i <= data->end; i += PROD_BLOCK)
+    {
+        if (atomic_load(&found_zero))
+        {
+            return DIVISION_CANCELLED;
+        }
+
+        int n = (data->end - i + 1 < PROD_BLOCK) ? (data->end - i + 1) : PROD_BLOCK;
+        HistogramCount(gData + i, n, h);
+        if (h->count[0][0] | h->count[1][0] | h->count[2][0] | h->count[3][0])
+        {
+            atomic_store(&found_zero, true);
+            return DIVISION_ZERO;
+        }
+    }
+    return DIVISION_DONE;
+}
+
+// One histogram per possible worker, allocated on first use
+static void AllocHistograms(void)
+{
+    if (gHistograms == NULL)
+    {
+        gHistograms = aligned_alloc(CACHE_LINE, MAX_THREADS * sizeof(Histogram));
+        if (gHistograms == NULL)
+        {
+            fprintf(stderr, "Out of memory for the histograms\n");
+            exit(-1);
+        }
+    }
+}
+
+// The histograms only have counters for 0..MAX_RANDOM_NUMBER, so data that is not known
+// to lie in that range goes to the product kernels
+uint32_t SqFindProdHist(int size)
+{
+    ThreadData all = {0, 0, size - 1, 1};
+
+    if (!gDataInRange)
+    {
+        return SqFindProd(size);
+    }
+    AllocHistograms();
+    atomic_store(&found_zero, false);
+    return (HistogramDivision(&all) == DIVISION_DONE) ? HistogramProduct(1, MAX_RANDOM_NUMBER, 1) : 0;
+}
+
+void *ThHistogramCount(void *param)
+{
+    HistogramDivision((ThreadData *)param);
+    return NULL;
+}
+
+void *ThHistogramPower(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    int first = 1 + data->id * MAX_RANDOM_NUMBER / gThreadCount;
+    int last = (data->id + 1) * MAX_RANDOM_NUMBER / gThreadCount;
+
+    PublishResult(data->id, HistogramProduct(first, last, gThreadCount));
+    return NULL;
+}
+
+// Two jobs: count the divisions, then (unless a zero was found) raise the values to
+// their counts, split by value
+uint32_t RunHistogramScheme(Job *job, long *elapsed)
+{
+    uint32_t prod;
+
+    if (!gDataInRange)
+    {
+        return RunJoinScheme(job, elapsed);
+    }
+    AllocHistograms();
+    InitSharedVars();
+
+    SetTime();
+    job->routine = ThHistogramCount;
+    PoolSubmit(job);
+    PoolJoin();
+    if (atomic_load(&found_zero))
+    {
+        prod = 0;
+    }
+    else
+    {
+        job->routine = ThHistogramPower;
+        PoolSubmit(job);
+        PoolJoin();
+        prod = ComputeTotalProduct();
+    }
+    *elapsed = GetTime();
+    return prod;
+}
+
+// The histogram trades a multiply-mod per element for a counter increment per element
+// plus a ModPow per value, which only pays off with many elements per value. The choice
+// only depends on the array size and the value range, so the same input always gets the
+// same output
+bool HistogramPays(int size)
+{
+    return (long long)size >= (long long)HIST_MIN_RATIO * HIST_DOMAIN && gData != NULL && gDataInRange;
+}
+
+void RunHistogramEngines(Job *job, int size)
+{
+    uint32_t prod;
+    long elapsed;
+
+    SetTime();
+    prod = SqFindProdHist(size);
+    elapsed = GetTime();
+    printf("Sequential histogram multiplication completed in %.3f ms. Product = %u\n", elapsed / 1e6, prod);
+    prod = RunHistogramScheme(job, &elapsed);
+    printf("Threaded histogram multiplication completed in %.3f ms. Product = %u\n", elapsed / 1e6, prod);
+}
+
+// Sum of a block. The elements are sign-extended into 64-bit lanes, since unchecked
+// input (DataRange runs before any check) can hold any int
+static inline __attribute__((always_inline)) int64_t SumBlock(const int *data, int n)
+{
+    int64_t sum = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        sum += data[i];
+    }
+    return sum;
+}
+
+static inline __attribute__((always_inline)) int MinBlock(const int *data, int n, int m)
+{
+    for (int i = 0; i < n; i++)
+    {
+        m = (data[i] < m) ? data[i] : m;
+    }
+    return m;
+}
+
+static inline __attribute__((always_inline)) int MaxBlock(const int *data, int n, int m)
+{
+    for (int i = 0; i < n; i++)
+    {
+        m = (data[i] > m) ? data[i] : m;
+    }
+    return m;
+}
+
+static inline __attribute__((always_inline)) int ZerosBlock(const int *data, int n)
+{
+    int count = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        count += (data[i] == 0);
+    }
+    return count;
+}
+
+static int64_t CombineSum(int64_t a, int64_t b, const Reducer *r)
+{
+    (void)r;
+    return a + b;
+}
+
+static int64_t CombineMin(int64_t a, int64_t b, const Reducer *r)
+{
+    (void)r;
+    return (a < b) ? a : b;
+}
+
+static int64_t CombineMax(int64_t a, int64_t b, const Reducer *r)
+{
+    (void)r;
+    return (a > b) ? a : b;
+}
+
+static int64_t FoldProd(int64_t acc, const int *data, int n, const Reducer *r)
+{
+    return (acc == 0) ? 0 : ModMul((uint32_t)acc, gProdModKernel(data, n, r->mod), r->mod);
+}
+
+static int64_t CombineProd(int64_t a, int64_t b, const Reducer *r)
+{
+    return ModMul((uint32_t)a, (uint32_t)b, r->mod);
+}
+
+// Parse a comma-separated list of reductions into reducers
+int ParseReducers(const char *list, Reducer *reducers)
+{
+    char copy[256], *save;
+    int count = 0;
+
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char *token = strtok_r(copy, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+        Reducer *r = &reducers[count];
+        unsigned long m;
+        char *end;
+
+        if (count == MAX_REDUCERS)
+        {
+            fprintf(stderr, "At most %d reductions\n", MAX_REDUCERS);
+            exit(-1);
+        }
+        snprintf(r->name, sizeof(r->name), "%s", token);
+        if (strcmp(token, "sum") == 0)
+        {
+            *r = (Reducer){.name = "sum", .kind = REDUCE_SUM, .identity = 0, .combine = CombineSum};
+        }
+        else if (strcmp(token, "min") == 0)
+        {
+            *r = (Reducer){.name = "min", .kind = REDUCE_MIN, .identity = INT_MAX, .combine = CombineMin};
+        }
+        else if (strcmp(token, "max") == 0)
+        {
+            *r = (Reducer){.name = "max", .kind = REDUCE_MAX, .identity = INT_MIN, .combine = CombineMax};
+        }
+        else if (strcmp(token, "zeros") == 0)
+        {
+            *r = (Reducer){.name = "zeros", .kind = REDUCE_ZEROS, .identity = 0, .combine = CombineSum};
+        }
+        else if (strncmp(token, "prod:", 5) == 0 && (m = strtoul(token + 5, &end, 10)) >= 2 && m <= UINT32_MAX && *end == '\0')
+        {
+            r->kind = REDUCE_GENERIC;
+            r->identity = 1;
+            r->fold = FoldProd;
+            r->combine = CombineProd;
+            InitModulus(&r->mod, (uint32_t)m);
+        }
+        else
+        {
+            fprintf(stderr, "Invalid reduction %s\n", token);
+            exit(-1);
+        }
+        count++;
+    }
+    return count;
+}
+
+// Compute count reductions over the job's divisions in one pass and combine the
+// workers' states in division order (so non-commutative operators would work too)
+void RunReductions(const Reducer *reducers, int count, Job *job, int64_t *results)
+{
+    gReducers = reducers;
+    gReducerCount = count;
+    job->routine = ThReduce;
+    PoolSubmit(job);
+    PoolJoin();
+
+    for (int r = 0; r < count; r++)
+    {
+        results[r] = reducers[r].identity;
+        for (int i = 0; i < gThreadCount; i++)
+        {
+            results[r] = reducers[r].combine(results[r], gReduceSlots[i].acc[r], &reducers[r]);
+        }
+    }
+}
+
+void *ThReduce(void *param)
+{
+    gReduceDivision((ThreadData *)param);
+    return NULL;
+}
+
+// The block loops are inlined here, so each wrapper below gets them vectorized for its
+// instruction set
+static inline __attribute__((always_inline)) void ReduceDivisionBody(ThreadData *data)
+{
+    int64_t acc[MAX_REDUCERS]; // Sums and generic states
+    int small[MAX_REDUCERS];   // Minima, maxima and zero counts (a division has fewer than INT_MAX elements)
+
+    for (int r = 0; r < gReducerCount; r++)
+    {
+        acc[r] = gReducers[r].identity;
+        small[r] = (int)gReducers[r].identity;
+    }
+    for (int i = data->start; i <= data->end; i += REDUCE_BLOCK)
+    {
+        const int *block = gData + i;
+        int n = (data->end - i + 1 < REDUCE_BLOCK) ? data->end - i + 1 : REDUCE_BLOCK;
+        for (int r = 0; r < gReducerCount; r++)
+        {
+            switch (gReducers[r].kind)
+            {
+            case REDUCE_SUM:
+                acc[r] += SumBlock(block, n);
+                break;
+            case REDUCE_MIN:
+                small[r] = MinBlock(block, n, small[r]);
+                break;
+            case REDUCE_MAX:
+                small[r] = MaxBlock(block, n, small[r]);
+                break;
+            case REDUCE_ZEROS:
+                small[r] += ZerosBlock(block, n);
+                break;
+            default:
+                acc[r] = gReducers[r].fold(acc[r], block, n, &gReducers[r]);
+                break;
+            }
+        }
+    }
+    for (int r = 0; r < gReducerCount; r++)
+    {
+        bool isSmall = gReducers[r].kind == REDUCE_MIN || gReducers[r].kind == REDUCE_MAX || gReducers[r].kind == REDUCE_ZEROS;
+        gReduceSlots[data->id].acc[r] = isSmall ? small[r] : acc[r];
+    }
+}
+
+void ReduceDivisionSse2(ThreadData *data)
+{
+    ReduceDivisionBody(data);
+}
+
+__attribute__((target("avx2"))) void ReduceDivisionAvx2(ThreadData *data)
+{
+    ReduceDivisionBody(data);
+}
+
+int MtfpInit(int threads, uint32_t modulus)
+{
+    Job job = {0}; // ThServeBatches ignores the divisions
+
+    if (gLibRunning || threads <= 0 || threads > MAX_THREADS || modulus < 2)
+    {
+        return -1;
+    }
+    InitModulus(&gMod, modulus);
+    SelectProdKernel();
+    pthread_mutex_init(&gLibLock, NULL);
+    pthread_cond_init(&gLibWork, NULL);
+    pthread_cond_init(&gLibDone, NULL);
+    gLibHead = gLibTail = NULL;
+    gLibQuit = false;
+    gLibRunning = true;
+
+    gThreadCount = threads;
+    PoolInit(threads);
+    job.routine = ThServeBatches;
+    PoolSubmit(&job);
+    return 0;
+}
+
+// Pack the arrays and append the batch to the queue. Consecutive small arrays share a
+// pack until it holds LIB_PACK_ELEMENTS elements; larger arrays are cut into pieces.
+// Library code never exits the host: every failure returns NULL
+MtfpBatch *MtfpSubmit(const MtfpArray *arrays, int count, uint32_t *results, MtfpCallback callback, void *user)
+{
+    MtfpBatch *batch;
+    long capacity = 0; // Every array makes at most one whole pack or its pieces
+    int pending = 0, first = 0;
+
+    // Without a running library no worker would ever serve the batch
+    if (!gLibRunning || count < 0 || (count > 0 && arrays == NULL) || (results == NULL && callback == NULL))
+    {
+        return NULL;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (arrays[i].length < 0 || (arrays[i].length > 0 && arrays[i].data == NULL))
+        {
+            return NULL;
+        }
+        capacity += (arrays[i].length > LIB_PACK_ELEMENTS) ? (arrays[i].length + LIB_PACK_ELEMENTS - 1) / LIB_PACK_ELEMENTS : 1;
+    }
+    batch = calloc(1, sizeof(MtfpBatch));
+    if (batch == NULL || (batch->state = malloc((count + 1) * sizeof(LibArrayState))) == NULL ||
+        (batch->packs = malloc((capacity + 1) * sizeof(LibPack))) == NULL)
+    {
+        MtfpRelease(batch);
+        return NULL;
+    }
+    batch->arrays = arrays;
+    batch->count = count;
+    batch->results = results;
+    batch->callback = callback;
+    batch->user = user;
+    atomic_init(&batch->remaining, count);
+    atomic_init(&batch->done, count == 0);
+
+    for (int i = 0; i <= count; i++)
+    {
+        int length = (i < count) ? arrays[i].length : 0;
+        int pieces = (length > LIB_PACK_ELEMENTS) ? (length + LIB_PACK_ELEMENTS - 1) / LIB_PACK_ELEMENTS : 1;
+
+        // Close the open pack of whole arrays before a large array, one that would not
+        // fit in it any more, or the end of the batch
+        if (i > first && (i == count || pieces > 1 || pending + length > LIB_PACK_ELEMENTS))
+        {
+            batch->packs[batch->packCount++] = (LibPack){first, i - 1, 0, -1};
+            first = i;
+            pending = 0;
+        }
+        if (i == count)
+        {
+            break;
+        }
+        atomic_init(&batch->state[i].pending, pieces);
+        atomic_init(&batch->state[i].prod, 1);
+        if (pieces > 1)
+        {
+            for (int p = 0; p < pieces; p++)
+            {
+                int offset = p * LIB_PACK_ELEMENTS;
+                int n = (length - offset < LIB_PACK_ELEMENTS) ? length - offset : LIB_PACK_ELEMENTS;
+                batch->packs[batch->packCount++] = (LibPack){i, i, offset, n};
+            }
+            first = i + 1;
+        }
+        else
+        {
+            pending += length;
+        }
+    }
+
+    pthread_mutex_lock(&gLibLock);
+    if (gLibQuit)
+    {
+        // MtfpShutdown has begun: the workers may already be gone
+        pthread_mutex_unlock(&gLibLock);
+        MtfpRelease(batch);
+        return NULL;
+    }
+    if (batch->packCount > 0)
+    {
+        if (gLibTail != NULL)
+        {
+            gLibTail->next = batch;
+        }
+        else
+        {
+            gLibHead = batch;
+        }
+        gLibTail = batch;
+        pthread_cond_broadcast(&gLibWork);
+    }
+    pthread_mutex_unlock(&gLibLock);
+    return batch;
+}
+
+bool MtfpPoll(MtfpBatch *batch)
+{
+    return atomic_load_explicit(&batch->done, memory_order_acquire);
+}
+
+void MtfpWait(MtfpBatch *batch)
+{
+    pthread_mutex_lock(&gLibLock);
+    while (!atomic_load_explicit(&batch->done, memory_order_acquire))
+    {
+        pthread_cond_wait(&gLibDone, &gLibLock);
+    }
+    pthread_mutex_unlock(&gLibLock);
+}
+
+void MtfpRelease(MtfpBatch *batch)
+{
+    if (batch == NULL)
+    {
+        return;
+    }
+    free(batch->packs);
+    free(batch->state);
+    free(batch);
+}
+
+// The workers finish every queued batch before they stop
+void MtfpShutdown(void)
+{
+    if (!gLibRunning)
+    {
+        return;
+    }
+    pthread_mutex_lock(&gLibLock);
+    gLibQuit = true;
+    pthread_cond_broadcast(&gLibWork);
+    pthread_mutex_unlock(&gLibLock);
+    PoolShutdown();
+    pthread_cond_destroy(&gLibDone);
+    pthread_cond_destroy(&gLibWork);
+    pthread_mutex_destroy(&gLibLock);
+    gLibRunning = false;
+}
+
+void *ThServeBatches(void *param)
+{
+    (void)param; // Every worker serves the same queue
+    while (1)
+    {
+        pthread_mutex_lock(&gLibLock);
+        while (gLibHead == NULL && !gLibQuit)
+        {
+            pthread_cond_wait(&gLibWork, &gLibLock);
+        }
+        if (gLibHead == NULL)
+        {
+            pthread_mutex_unlock(&gLibLock);
+            return NULL;
+        }
+        MtfpBatch *batch = gLibHead;
+        LibPack pack = batch->packs[batch->nextPack++];
+        if (batch->nextPack == batch->packCount)
+        {
+            gLibHead = batch->next; // Its last pack is handed out; it stays alive until done
+            if (gLibHead == NULL)
+            {
+                gLibTail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&gLibLock);
+
+        if (pack.length < 0)
+        {
+            for (int i = pack.first; i <= pack.last; i++)
+            {
+                LibFinishArray(batch, i, gProdKernel(batch->arrays[i].data, batch->arrays[i].length));
+            }
+            continue;
+        }
+
+        // A piece: fold it into the array's product, the last piece finishes the array
+        LibArrayState *state = &batch->state[pack.first];
+        uint32_t piece = gProdKernel(batch->arrays[pack.first].data + pack.offset, pack.length);
+        unsigned prod = atomic_load_explicit(&state->prod, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&state->prod, &prod, ModMul(prod, piece, gMod), memory_order_relaxed, memory_order_relaxed))
+        {
+        }
+        if (atomic_fetch_sub_explicit(&state->pending, 1, memory_order_acq_rel) == 1)
+        {
+            LibFinishArray(batch, pack.first, atomic_load_explicit(&state->prod, memory_order_relaxed));
+        }
+    }
+}
+
+// Deliver the product of array i; the worker finishing the batch's last array marks the
+// batch done and wakes MtfpWait()
+void LibFinishArray(MtfpBatch *batch, int i, uint32_t prod)
+{
+    if (batch->results != NULL)
+    {
+        batch->results[i] = prod;
+    }
+    if (batch->callback != NULL)
+    {
+        batch->callback(batch->user, i, prod);
+    }
+    if (atomic_fetch_sub_explicit(&batch->remaining, 1, memory_order_acq_rel) == 1)
+    {
+        pthread_mutex_lock(&gLibLock);
+        atomic_store_explicit(&batch->done, true, memory_order_release);
+        pthread_cond_broadcast(&gLibDone);
+        pthread_mutex_unlock(&gLibLock);
+    }
+}
+
+static inline IndexNode IndexLeaf(int value)
+{
+    uint32_t residue = ModReduce((uint32_t)value, gMod);
+    IndexNode leaf = {residue == 0 ? 1 : residue, residue == 0};
+    return leaf;
+}
+
+static inline IndexNode IndexCombine(IndexNode a, IndexNode b)
+{
+    IndexNode node = {ModMul(a.prod, b.prod, gMod), a.zeros + b.zeros};
+    return node;
+}
+
+// The leaves are cut into blocks, at least one per worker, and every worker builds the
+// whole subtrees of its blocks (first-touching their nodes); the parent then builds the
+// few levels above the block roots
+void IndexBuild(int size)
+{
+    Job job = {0}; // ThIndexBuild uses the worker id only
+
+    gIndex.size = size;
+    gIndex.leaves = 1;
+    while (gIndex.leaves < size)
+    {
+        gIndex.leaves *= 2;
+    }
+    gIndex.blocks = 1;
+    while (gIndex.blocks < gThreadCount && gIndex.blocks < gIndex.leaves)
+    {
+        gIndex.blocks *= 2;
+    }
+    gIndex.bytes = 2 * (size_t)gIndex.leaves * sizeof(IndexNode);
+    gIndex.nodes = mmap(NULL, gIndex.bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (gIndex.nodes == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(-1);
+    }
+    if (gHugePages != HUGEPAGES_OFF && gIndex.bytes >= HUGE_PAGE_SIZE)
+    {
+        madvise(gIndex.nodes, gIndex.bytes, MADV_HUGEPAGE); // Only a hint, ignore failures
+    }
+
+    job.routine = ThIndexBuild;
+    PoolSubmit(&job);
+    PoolJoin();
+    for (int k = gIndex.blocks - 1; k >= 1; k--)
+    {
+        gIndex.nodes[k] = IndexCombine(gIndex.nodes[2 * k], gIndex.nodes[2 * k + 1]);
+    }
+}
+
+void *ThIndexBuild(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    int blockLeaves = gIndex.leaves / gIndex.blocks;
+    IndexNode identity = {1, 0};
+
+    for (int b = data->id; b < gIndex.blocks; b += gThreadCount)
+    {
+        long lo = gIndex.leaves + (long)b * blockLeaves, hi = lo + blockLeaves;
+        for (long k = lo; k < hi; k++)
+        {
+            long i = k - gIndex.leaves;
+            gIndex.nodes[k] = (i < gIndex.size) ? IndexLeaf(gData[i]) : identity;
+        }
+        while (hi - lo > 1) // One level up, until the block's root
+        {
+            lo /= 2;
+            hi /= 2;
+            for (long k = lo; k < hi; k++)
+            {
+                gIndex.nodes[k] = IndexCombine(gIndex.nodes[2 * k], gIndex.nodes[2 * k + 1]);
+            }
+        }
+    }
+    return NULL;
+}
+
+void IndexUpdate(int i, int value)
+{
+    long k = gIndex.leaves + (long)i;
+
+    gData[i] = value;
+    gIndex.nodes[k] = IndexLeaf(value);
+    for (k /= 2; k >= 1; k /= 2)
+    {
+        gIndex.nodes[k] = IndexCombine(gIndex.nodes[2 * k], gIndex.nodes[2 * k + 1]);
+    }
+}
+
+// Bottom-up: l and r move up one level per step, taking in the nodes that hang off the
+// range's borders. Inclusive l, exclusive r while walking
+uint32_t IndexQuery(int l, int r)
+{
+    IndexNode acc = {1, 0};
+    long lo = gIndex.leaves + (long)l, hi = gIndex.leaves + (long)r + 1;
+
+    for (; lo < hi; lo /= 2, hi /= 2)
+    {
+        if (lo & 1)
+        {
+            acc = IndexCombine(acc, gIndex.nodes[lo++]);
+        }
+        if (hi & 1)
+        {
+            acc = IndexCombine(acc, gIndex.nodes[--hi]);
+        }
+    }
+    return (acc.zeros > 0) ? 0 : acc.prod;
+}
+
+void IndexFree(void)
+{
+    if (gIndex.nodes != NULL)
+    {
+        munmap(gIndex.nodes, gIndex.bytes);
+        gIndex.nodes = NULL;
+    }
+}
+
+// Build the index, then run queries random range queries interleaved with random point
+// updates and check every query against the sequential product of the same range. One
+// update in 16 writes a zero, so the zero counts get exercised. Afterwards the queries
+// and updates are timed on their own
+void RunIndexCheck(int size, int queries)
+{
+    long elapsed;
+    int mismatches = 0;
+    uint64_t rng = RANDOM_SEED;
+    long long seqNs = 0;
+
+    SetTime();
+    IndexBuild(size);
+    elapsed = GetTime();
+    printf("Range index over %d elements built in %.3f ms\n", size, elapsed / 1e6);
+    if (IndexQuery(0, size - 1) != SqFindProd(size))
+    {
+        mismatches++;
+    }
+
+    for (int q = 0; q < queries; q++)
+    {
+        uint64_t r = SplitMix64(rng++);
+        int i = (int)(r % size);
+        int value = ((r >> 32) % 16 == 0) ? 0 : (int)((r >> 36) % MAX_RANDOM_NUMBER) + 1;
+        IndexUpdate(i, value);
+
+        r = SplitMix64(rng++);
+        int l = (int)(r % size), h = (int)((r >> 32) % size);
+        if (l > h)
+        {
+            int t = l;
+            l = h;
+            h = t;
+        }
+        long long start = NowNs();
+        uint32_t expected = ScanAndMultiply(gData + l, h - l + 1); // SqFindProd on the range
+        seqNs += NowNs() - start;
+        if (IndexQuery(l, h) != expected)
+        {
+            mismatches++;
+            fprintf(stderr, "Range index mismatch on [%d, %d]: %u instead of %u\n", l, h, IndexQuery(l, h), expected);
+        }
+    }
+    printf("%d random range queries and updates checked against the sequential product: %d mismatches\n", queries, mismatches);
+
+    volatile uint32_t sink = 0;
+    SetTime();
+    for (int q = 0; q < queries; q++)
+    {
+        uint64_t r = SplitMix64(rng++);
+        int l = (int)(r % size), h = (int)((r >> 32) % size);
+        sink ^= IndexQuery(l < h ? l : h, l < h ? h : l);
+    }
+    long queryNs = GetTime();
+    SetTime();
+    for (int q = 0; q < queries; q++)
+    {
+        uint64_t r = SplitMix64(rng++);
+        int i = (int)(r % size);
+        IndexUpdate(i, gData[i]);
+    }
+    long updateNs = GetTime();
+    (void)sink;
+    printf("Range query %.1f ns, point update %.1f ns, sequential range product %.1f us on average\n",
+           (double)queryNs / queries, (double)updateNs / queries, seqNs / 1e3 / queries);
+    IndexFree();
+}
+
+// Cut every division of the job into tasks of STEAL_TASK_SIZE elements and give each
+// worker a full deque of the tasks of its own division. Tasks are indexed globally, so
+// a deque only needs its top and bottom positions into gStealTasks
+void InitStealTasks(const Job *job)
+{
+    static int capacity = 0;
+    int count = 0;
+
+    for (int i = 0; i < gThreadCount; i++)
+    {
+        count += (job->indices[i][2] - job->indices[i][1] + STEAL_TASK_SIZE) / STEAL_TASK_SIZE;
+    }
+    if (count > capacity)
+    {
+        free(gStealTasks);
+        gStealTasks = malloc(count * sizeof(StealTask));
+        if (gStealTasks == NULL)
+        {
+            fprintf(stderr, "Out of memory for the work-stealing tasks\n");
+            exit(-1);
+        }
+        capacity = count;
+    }
+
+    count = 0;
+    for (int i = 0; i < gThreadCount; i++)
+    {
+        atomic_store_explicit(&gDeques[i].top, count, memory_order_relaxed);
+        for (int start = job->indices[i][1]; start <= job->indices[i][2]; start += STEAL_TASK_SIZE)
+        {
+            gStealTasks[count].start = start;
+            gStealTasks[count].end = (job->indices[i][2] - start < STEAL_TASK_SIZE) ? job->indices[i][2] : start + STEAL_TASK_SIZE - 1;
+            count++;
+        }
+        atomic_store_explicit(&gDeques[i].bottom, count, memory_order_relaxed);
+    }
+    // PoolSubmit() publishes the deques to the workers through the pool mutex
+}
+
+// Owner side of the deque: take the newest task. The only conflict is with a thief
+// going for the same last task, which is settled by the CAS on top
+long DequeTake(TaskDeque *deque)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b)
+    {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return DEQUE_EMPTY;
+    }
+    if (t == b)
+    {
+        // Last task: race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        {
+            b = DEQUE_EMPTY;
+        }
+        atomic_store_explicit(&deque->bottom, t + 1, memory_order_relaxed);
+    }
+    return b;
+}
+
+// Thief side of the deque: take the oldest task
+long DequeSteal(TaskDeque *deque)
+{
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (t >= b)
+    {
+        return DEQUE_EMPTY;
+    }
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+    {
+        return DEQUE_ABORT;
+    }
+    return t;
+}
+
+// Zero fast path of the thread functions: scan the division ZERO_SCAN_BLOCK elements at a
+// time and set found_zero if it holds a zero. Returns DIVISION_DONE if the worker should
+// go on multiplying (no zero, or -zeroscan is off)
+DivisionResult ScanForZero(ThreadData *data)
+{
+    if (!gZeroScan)
+    {
+        return DIVISION_DONE;
+    }
+    for (int i = data->start; i <= data->end; i += ZERO_SCAN_BLOCK)
+    {
+        if (atomic_load(&found_zero))
+        {
+            return DIVISION_CANCELLED;
+        }
+
+        int n = (data->end - i + 1 < ZERO_SCAN_BLOCK) ? (data->end - i + 1) : ZERO_SCAN_BLOCK;
+        if (FindZeroRange(i, n) >= 0)
+        {
+            atomic_store(&found_zero, true);
+            return DIVISION_ZERO;
+        }
+    }
+    return DIVISION_DONE;
+}
+
+// SSE2 zero scan: compare 16 elements per iteration against zero and locate the first
+// match with a movemask only once a group contains one
+int FindZeroSse2(const int *data, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i z0 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(data + i)), zero);
+        __m128i z1 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(data + i + 4)), zero);
+        __m128i z2 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(data + i + 8)), zero);
+        __m128i z3 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(data + i + 12)), zero);
+        __m128i any = _mm_or_si128(_mm_or_si128(z0, z1), _mm_or_si128(z2, z3));
+        if (_mm_movemask_epi8(any) != 0)
+        {
+            unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(z0)) | (_mm_movemask_ps(_mm_castsi128_ps(z1)) << 4) |
+                            (_mm_movemask_ps(_mm_castsi128_ps(z2)) << 8) | (_mm_movemask_ps(_mm_castsi128_ps(z3)) << 12);
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < n; i++)
+    {
+        if (data[i] == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// AVX2 zero scan, same scheme as FindZeroSse2 with 32 elements per iteration
+__attribute__((target("avx2"))) int FindZeroAvx2(const int *data, int n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i z0 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(data + i)), zero);
+        __m256i z1 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(data + i + 8)), zero);
+        __m256i z2 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(data + i + 16)), zero);
+        __m256i z3 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(data + i + 24)), zero);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(z0, z1), _mm256_or_si256(z2, z3));
+        if (!_mm256_testz_si256(any, any))
+        {
+            uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(z0)) | (_mm256_movemask_ps(_mm256_castsi256_ps(z1)) << 8) |
+                            (_mm256_movemask_ps(_mm256_castsi256_ps(z2)) << 16) | ((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(z3)) << 24);
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < n; i++)
+    {
+        if (data[i] == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The original sequential loop: a single dependent chain with a division per element
+// Kept as the reference the faster kernels are checked against
+uint32_t ProdKernelRef(const int *data, int n)
+{
+    uint64_t product = 1;
+    for (int i = 0; i < n; i++)
+    {
+        if (data[i] == 0)
+        {
+            return 0; // Terminate early if zero is found
+        }
+        product = (product * data[i]) % gMod.value; // Compute product mod gMod
+    }
+    return (uint32_t)product;
+}
+
+// Scalar kernel body: four independent 64-bit chains, each multiplying group elements
+// (at most MAX_RANDOM_NUMBER^group) into the accumulator before a single reduction
+// Inlined into every kernel so that a constant m and group are folded in
+static inline __attribute__((always_inline)) uint32_t ProdScalarBody(const int *data, int n, Modulus m, int group)
+{
+    uint64_t acc[4] = {1, 1, 1, 1};
+    int step = 4 * group;
+    int i = 0;
+
+    for (; i + step <= n; i += step)
+    {
+        for (int a = 0; a < 4; a++)
+        {
+            const int *p = data + i + group * a;
+            uint64_t x = (uint64_t)(p[0] * p[1]);
+            if (group == 4)
+            {
+                x *= (uint64_t)(p[2] * p[3]);
+            }
+            acc[a] = ModReduce(acc[a] * x, m);
+        }
+        if (i % PROD_BLOCK < step && (acc[0] == 0 || acc[1] == 0 || acc[2] == 0 || acc[3] == 0))
+        {
+            return 0;
+        }
+    }
+
+    uint32_t product = ModMul(ModMul(acc[0], acc[1], m), ModMul(acc[2], acc[3], m), m);
+    for (; i < n; i++)
+    {
+        product = ModMul(product, data[i], m);
+    }
+    return product;
+}
+
+// Combine the lanes of the double-precision accumulators into one product in [0, m.value)
+// The lanes hold signed residues, see ProdAvx2Body
+static inline __attribute__((always_inline)) uint32_t CombineLanes(const double *lanes, int count, const int *tail, int tailCount, Modulus m)
+{
+    uint32_t product = 1;
+    for (int l = 0; l < count; l++)
+    {
+        int64_t r = (int64_t)lanes[l] % (int64_t)m.value;
+        product = ModMul(product, (uint32_t)(r < 0 ? r + m.value : r), m);
+    }
+    for (int i = 0; i < tailCount; i++)
+    {
+        product = ModMul(product, tail[i], m);
+    }
+    return product;
+}
+
+// SSE4.1 kernel body, same scheme as ProdAvx2Body with two lanes per register
+static inline __attribute__((always_inline, target("sse4.1"))) uint32_t ProdSse4Body(const int *data, int n, Modulus m, int depth)
+{
+    const __m128d mod = _mm_set1_pd((double)m.value);
+    const __m128d inv = _mm_set1_pd(m.inv);
+    const int step = 8 * depth;
+    __m128d acc[4];
+    double lanes[8];
+    int i = 0;
+
+    for (int a = 0; a < 4; a++)
+    {
+        acc[a] = _mm_set1_pd(1.0);
+    }
+    for (; i + step <= n; i += step)
+    {
+        for (int r = 0; r < depth; r++)
+        {
+            for (int a = 0; a < 4; a++)
+            {
+                __m128i x = _mm_loadl_epi64((const __m128i *)(data + i + 8 * r + 2 * a));
+                acc[a] = _mm_mul_pd(acc[a], _mm_cvtepi32_pd(x));
+            }
+        }
+        for (int a = 0; a < 4; a++)
+        {
+            __m128d q = _mm_round_pd(_mm_mul_pd(acc[a], inv), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            acc[a] = _mm_sub_pd(acc[a], _mm_mul_pd(q, mod));
+        }
+        if (i % PROD_BLOCK < step)
+        {
+            __m128d zero = _mm_setzero_pd();
+            __m128d z = _mm_or_pd(_mm_or_pd(_mm_cmpeq_pd(acc[0], zero), _mm_cmpeq_pd(acc[1], zero)),
+                                  _mm_or_pd(_mm_cmpeq_pd(acc[2], zero), _mm_cmpeq_pd(acc[3], zero)));
+            if (_mm_movemask_pd(z) != 0)
+            {
+                return 0;
+            }
+        }
+    }
+
+    for (int a = 0; a < 4; a++)
+    {
+        _mm_storeu_pd(lanes + 2 * a, acc[a]);
+    }
+    return CombineLanes(lanes, 8, data + i, n - i, m);
+}
+
+// AVX2 kernel body: sixteen independent accumulators in four registers of four doubles
+// Each lane is multiplied by depth elements and then reduced with the precomputed
+// reciprocal: q = round(acc * m.inv) and acc -= q * m.value. InitModulus() picks depth
+// so that acc stays below 2^50 before the reduction; then both products are exact
+// integers, q is off by at most one, and the lane keeps an exact signed residue with
+// |acc| <= m.value without any division
+static inline __attribute__((always_inline, target("avx2"))) uint32_t ProdAvx2Body(const int *data, int n, Modulus m, int depth)
+{
+    const __m256d mod = _mm256_set1_pd((double)m.value);
+    const __m256d inv = _mm256_set1_pd(m.inv);
+    const int step = 16 * depth;
+    __m256d acc[4];
+    double lanes[16];
+    int i = 0;
+
+    for (int a = 0; a < 4; a++)
+    {
+        acc[a] = _mm256_set1_pd(1.0);
+    }
+    for (; i + step <= n; i += step)
+    {
+        for (int r = 0; r < depth; r++)
+        {
+            for (int a = 0; a < 4; a++)
+            {
+                __m128i x = _mm_loadu_si128((const __m128i *)(data + i + 16 * r + 4 * a));
+                acc[a] = _mm256_mul_pd(acc[a], _mm256_cvtepi32_pd(x));
+            }
+        }
+        for (int a = 0; a < 4; a++)
+        {
+            __m256d q = _mm256_round_pd(_mm256_mul_pd(acc[a], inv), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            acc[a] = _mm256_sub_pd(acc[a], _mm256_mul_pd(q, mod));
+        }
+        if (i % PROD_BLOCK < step)
+        {
+            __m256d zero = _mm256_setzero_pd();
+            __m256d z = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(acc[0], zero, _CMP_EQ_OQ), _mm256_cmp_pd(acc[1], zero, _CMP_EQ_OQ)),
+                                     _mm256_or_pd(_mm256_cmp_pd(acc[2], zero, _CMP_EQ_OQ), _mm256_cmp_pd(acc[3], zero, _CMP_EQ_OQ)));
+            if (_mm256_movemask_pd(z) != 0)
+            {
+                return 0;
+            }
+        }
+    }
+
+    for (int a = 0; a < 4; a++)
+    {
+        _mm256_storeu_pd(lanes + 4 * a, acc[a]);
+    }
+    return CombineLanes(lanes, 16, data + i, n - i, m);
+}
+
+// Generic kernels: reduce by m (gMod, for the schemes) with its runtime constants
+uint32_t ProdKernelScalarMod(const int *data, int n, Modulus m)
+{
+    return (m.scalarGroup == 4) ? ProdScalarBody(data, n, m, 4) : ProdScalarBody(data, n, m, 2);
+}
+
+__attribute__((target("sse4.1"))) uint32_t ProdKernelSse4Mod(const int *data, int n, Modulus m)
+{
+    switch (m.simdDepth)
+    {
+    case 3:
+        return ProdSse4Body(data, n, m, 3);
+    case 2:
+        return ProdSse4Body(data, n, m, 2);
+    default:
+        return ProdSse4Body(data, n, m, 1);
+    }
+}
+
+__attribute__((target("avx2"))) uint32_t ProdKernelAvx2Mod(const int *data, int n, Modulus m)
+{
+    switch (m.simdDepth)
+    {
+    case 3:
+        return ProdAvx2Body(data, n, m, 3);
+    case 2:
+        return ProdAvx2Body(data, n, m, 2);
+    default:
+        return ProdAvx2Body(data, n, m, 1);
+    }
+}
+
+uint32_t ProdKernelScalar(const int *data, int n)
+{
+    return ProdKernelScalarMod(data, n, gMod);
+}
+
+__attribute__((target("sse4.1"))) uint32_t ProdKernelSse4(const int *data, int n)
+{
+    return ProdKernelSse4Mod(data, n, gMod);
+}
+
+__attribute__((target("avx2"))) uint32_t ProdKernelAvx2(const int *data, int n)
+{
+    return ProdKernelAvx2Mod(data, n, gMod);
+}
+
+// Scalar body of the compact kernels, width is 16 or 12. Four chains of pairs as in
+// ProdScalarBody with group 2; the elements are decoded one at a time
+static inline __attribute__((always_inline)) uint32_t ProdPackedScalarBody(const uint8_t *base, long first, int n, Modulus m, int width)
+{
+    uint64_t acc[4] = {1, 1, 1, 1};
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        for (int a = 0; a < 4; a++)
+        {
+            long e = first + i + 2 * a;
+            uint64_t x = (uint64_t)(PackedElement(base, e, width) * PackedElement(base, e + 1, width));
+            acc[a] = ModReduce(acc[a] * x, m);
+        }
+        if (i % PROD_BLOCK < 8 && (acc[0] == 0 || acc[1] == 0 || acc[2] == 0 || acc[3] == 0))
+        {
+            return 0;
+        }
+    }
+
+    uint32_t product = ModMul(ModMul(acc[0], acc[1], m), ModMul(acc[2], acc[3], m), m);
+    for (; i < n; i++)
+    {
+        product = ModMul(product, PackedElement(base, first + i, width), m);
+    }
+    return product;
+}
+
+// Eight elements from element i of a compact buffer, widened to 32-bit ints. For 12 bits
+// i must be even: the 12 bytes of the four pairs are spread to one pair of bytes per
+// element, and the odd elements (the high 12 bits of their pair) shifted down
+static inline __attribute__((always_inline, target("avx2"))) __m256i LoadPacked8(const uint8_t *base, long i, int width)
+{
+    if (width == 16)
+    {
+        return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(base + 2 * i)));
+    }
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(base + 3 * (i >> 1)));
+    __m128i pairs = _mm_shuffle_epi8(bytes, _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11));
+    __m128i low = _mm_and_si128(pairs, _mm_set1_epi16(0x0FFF));
+    __m128i high = _mm_srli_epi16(pairs, 4);
+    return _mm256_cvtepu16_epi32(_mm_blend_epi16(low, high, 0xAA));
+}
+
+// AVX2 body of the compact kernels: ProdAvx2Body fed by LoadPacked8. An odd first element
+// of a 12-bit buffer is multiplied in separately so that the loads start on a pair
+static inline __attribute__((always_inline, target("avx2"))) uint32_t ProdPackedAvx2Body(const uint8_t *base, long first, int n, Modulus m, int depth, int width)
+{
+    const __m256d mod = _mm256_set1_pd((double)m.value);
+    const __m256d inv = _mm256_set1_pd(m.inv);
+    const int step = 16 * depth;
+    __m256d acc[4];
+    double lanes[16];
+    uint32_t head = 1;
+    int i = 0;
+
+    if (width == 12 && (first & 1) && n > 0)
+    {
+        head = PackedElement(base, first, width);
+        first++;
+        n--;
+    }
+    for (int a = 0; a < 4; a++)
+    {
+        acc[a] = _mm256_set1_pd(1.0);
+    }
+    for (; i + step <= n; i += step)
+    {
+        for (int r = 0; r < depth; r++)
+        {
+            __m256i x0 = LoadPacked8(base, first + i + 16 * r, width);
+            __m256i x1 = LoadPacked8(base, first + i + 16 * r + 8, width);
+            acc[0] = _mm256_mul_pd(acc[0], _mm256_cvtepi32_pd(_mm256_castsi256_si128(x0)));
+            acc[1] = _mm256_mul_pd(acc[1], _mm256_cvtepi32_pd(_mm256_extracti128_si256(x0, 1)));
+            acc[2] = _mm256_mul_pd(acc[2], _mm256_cvtepi32_pd(_mm256_castsi256_si128(x1)));
+            acc[3] = _mm256_mul_pd(acc[3], _mm256_cvtepi32_pd(_mm256_extracti128_si256(x1, 1)));
+        }
+        for (int a = 0; a < 4; a++)
+        {
+            __m256d q = _mm256_round_pd(_mm256_mul_pd(acc[a], inv), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            acc[a] = _mm256_sub_pd(acc[a], _mm256_mul_pd(q, mod));
+        }
+        if (i % PROD_BLOCK < step)
+        {
+            __m256d zero = _mm256_setzero_pd();
+            __m256d z = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(acc[0], zero, _CMP_EQ_OQ), _mm256_cmp_pd(acc[1], zero, _CMP_EQ_OQ)),
+                                     _mm256_or_pd(_mm256_cmp_pd(acc[2], zero, _CMP_EQ_OQ), _mm256_cmp_pd(acc[3], zero, _CMP_EQ_OQ)));
+            if (_mm256_movemask_pd(z) != 0)
+            {
+                return 0;
+            }
+        }
+    }
+
+    for (int a = 0; a < 4; a++)
+    {
+        _mm256_storeu_pd(lanes + 4 * a, acc[a]);
+    }
+    uint32_t product = ModMul(CombineLanes(lanes, 16, NULL, 0, m), head, m);
+    for (; i < n; i++)
+    {
+        product = ModMul(product, PackedElement(base, first + i, width), m);
+    }
+    return product;
+}
+
+// Compact kernels: the width is a compile-time constant of each, the modulus is gMod
+uint32_t ProdKernelScalarU16(const uint8_t *base, long first, int n)
+{
+    return ProdPackedScalarBody(base, first, n, gMod, 16);
+}
+
+uint32_t ProdKernelScalarU12(const uint8_t *base, long first, int n)
+{
+    return ProdPackedScalarBody(base, first, n, gMod, 12);
+}
+
+#define PACKED_AVX2_KERNEL(width)                                                                         \
+    __attribute__((target("avx2"))) uint32_t ProdKernelAvx2U##width(const uint8_t *base, long first, int n) \
+    {                                                                                                     \
+        switch (gMod.simdDepth)                                                                           \
+        {                                                                                                 \
+        case 3:                                                                                           \
+            return ProdPackedAvx2Body(base, first, n, gMod, 3, width);                                    \
+        case 2:                                                                                           \
+            return ProdPackedAvx2Body(base, first, n, gMod, 2, width);                                    \
+        default:                                                                                          \
+            return ProdPackedAvx2Body(base, first, n, gMod, 1, width);                                    \
+        }                                                                                                 \
+    }
+PACKED_AVX2_KERNEL(16)
+PACKED_AVX2_KERNEL(12)
+#undef PACKED_AVX2_KERNEL
+
+// Specialized kernels: the modulus and its constants are compile-time constants
+#define X(m, group, depth)                                                                            \
+    uint32_t ProdKernelScalar_##m(const int *data, int n)                                             \
+    {                                                                                                 \
+        return ProdScalarBody(data, n, MODULUS_CONST(m, group, depth), group);                        \
+    }                                                                                                 \
+    __attribute__((target("sse4.1"))) uint32_t ProdKernelSse4_##m(const int *data, int n)             \
+    {                                                                                                 \
+        return ProdSse4Body(data, n, MODULUS_CONST(m, group, depth), depth);                          \
+    }                                                                                                 \
+    __attribute__((target("avx2"))) uint32_t ProdKernelAvx2_##m(const int *data, int n)               \
+    {                                                                                                 \
+        return ProdAvx2Body(data, n, MODULUS_CONST(m, group, depth), depth);                          \
+    }
+SPECIALIZED_MODULI(X)
+#undef X
+
+// Every product kernel, with the modulus it is specialized for (0 for any modulus) and
+// the instruction set it needs (0 scalar, 1 SSE4.1, 2 AVX2)
+static const struct
+{
+    const char *name;
+    uint32_t modulus;
+    int isa;
+    ProdKernelFn fn;
+} gProdKernels[] = {
+#define X(m, group, depth)                          \
+    {"avx2/" #m, m, 2, ProdKernelAvx2_##m},         \
+        {"sse4.1/" #m, m, 1, ProdKernelSse4_##m},   \
+        {"scalar/" #m, m, 0, ProdKernelScalar_##m},
+    SPECIALIZED_MODULI(X)
+#undef X
+    {"avx2", 0, 2, ProdKernelAvx2},
+    {"sse4.1", 0, 1, ProdKernelSse4},
+    {"scalar", 0, 0, ProdKernelScalar},
+};
+
+#define PROD_KERNEL_COUNT ((int)(sizeof(gProdKernels) / sizeof(gProdKernels[0])))
+
+// Highest instruction set level of gProdKernels this CPU supports
+int CpuIsaLevel(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return 2;
+    }
+    return __builtin_cpu_supports("sse4.1") ? 1 : 0;
+}
+
+// Runtime CPU dispatch for gProdKernel: the first kernel in gProdKernels the CPU can run
+// that is specialized for gMod or works with any modulus
+void SelectProdKernel(void)
+{
+    int isa = CpuIsaLevel();
+
+    gFindZero = (isa >= 2) ? FindZeroAvx2 : FindZeroSse2;
+    gReduceDivision = (isa >= 2) ? ReduceDivisionAvx2 : ReduceDivisionSse2;
+    gProdModKernel = (isa >= 2) ? ProdKernelAvx2Mod : (isa == 1) ? ProdKernelSse4Mod : ProdKernelScalarMod;
+    for (int k = 0; k < PROD_KERNEL_COUNT; k++)
+    {
+        if (gProdKernels[k].isa <= isa && (gProdKernels[k].modulus == 0 || gProdKernels[k].modulus == gMod.value))
+        {
+            gProdKernel = gProdKernels[k].fn;
+            gProdKernelName = gProdKernels[k].name;
+            return;
+        }
+    }
+}
+
+// Compute the reduction constants for value once, so the kernels never divide by it
+// scalarGroup and simdDepth are the largest element counts that keep the lazily
+// reduced accumulators exact, assuming elements of at most MAX_RANDOM_NUMBER
+void InitModulus(Modulus *m, uint32_t value)
+{
+    double x = MAX_RANDOM_NUMBER;
+
+    m->value = value;
+    m->barrett = (uint64_t)(((unsigned __int128)1 << 64) / value);
+    m->inv = 1.0 / value;
+    m->scalarGroup = ((double)value * x * x * x * x < 18446744073709551616.0) ? 4 : 2;
+    m->simdDepth = 1;
+    while (m->simdDepth < 3 && 2.0 * value * pow(x, m->simdDepth + 1) < 1125899906842624.0)
+    {
+        m->simdDepth++;
+    }
+}
+
+// Compare every kernel this CPU can run against ProdKernelRef on random arrays of many
+// lengths (to cover all tail sizes), with and without a zero in them. Generic kernels
+// are checked with gMod and a few other moduli, specialized ones with their own modulus
+int SelfTestProdKernels(void)
+{
+    const int maxLen = 3 * PROD_BLOCK + 101;
+    const uint32_t moduli[] = {gMod.value, 2, 3001, 65537, 2147483647u, 4294967291u};
+    Modulus saved = gMod;
+    int isa = CpuIsaLevel();
+    int failures = 0;
+    int *data = malloc(maxLen * sizeof(int));
+
+    if (data == NULL)
+    {
+        fprintf(stderr, "Self-test: out of memory\n");
+        return 1;
+    }
+    srand(RANDOM_SEED);
+    for (int k = 0; k < PROD_KERNEL_COUNT; k++)
+    {
+        if (gProdKernels[k].isa > isa)
+        {
+            continue;
+        }
+        for (int j = 0; j < (int)(sizeof(moduli) / sizeof(moduli[0])); j++)
+        {
+            uint32_t modulus = gProdKernels[k].modulus ? gProdKernels[k].modulus : moduli[j];
+            InitModulus(&gMod, modulus);
+            for (int trial = 0; trial < 120; trial++)
+            {
+                int n = (trial < 100) ? trial : GetRand(100, maxLen);
+                for (int i = 0; i < n; i++)
+                {
+                    data[i] = GetRand(1, MAX_RANDOM_NUMBER);
+                }
+                if (n > 0 && trial % 3 == 0)
+                {
+                    data[GetRand(0, n - 1)] = 0;
+                }
+                uint32_t expected = ProdKernelRef(data, n);
+                uint32_t actual = gProdKernels[k].fn(data, n);
+                if (actual != expected)
+                {
+                    fprintf(stderr, "Self-test: %s kernel returned %u instead of %u for %d elements mod %u\n",
+                            gProdKernels[k].name, actual, expected, n, modulus);
+                    failures++;
+                }
+            }
+            if (gProdKernels[k].modulus)
+            {
+                break;
+            }
+        }
+    }
+    gMod = saved;
+
+    // Zero scans: every zero position (and none) for a range of lengths
+    for (int n = 0; n < 80; n++)
+    {
+        for (int z = -1; z < n; z++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                data[i] = (i == z) ? 0 : GetRand(1, MAX_RANDOM_NUMBER);
+            }
+            if (FindZeroSse2(data, n) != z || (isa >= 2 && FindZeroAvx2(data, n) != z))
+            {
+                fprintf(stderr, "Self-test: zero scan missed the zero at %d of %d elements\n", z, n);
+                failures++;
+            }
+        }
+    }
+    free(data);
+    return failures;
+}
+
+void InitSharedVars()
+{
+    int i;
+
+    for (i = 0; i < gThreadCount; i++)
+    {
+        atomic_store_explicit(&gThreadSlots[i].prod, 1, memory_order_relaxed);
+        atomic_store_explicit(&gThreadSlots[i].done, false, memory_order_relaxed);
+    }
+    gDoneThreadCount = 0;
+    atomic_store(&found_zero, false);
+}
+
+// Map an anonymous buffer of exactly size elements for gData. The mapping is page
+// aligned (so 64-byte aligned for the SIMD kernels) and its pages are only backed once
+// they are first written, by the generating workers. With HUGEPAGES_EXPLICIT the buffer
+// comes from the huge page pool and falls back to regular pages if that is empty
+void AllocData(int size)
+{
+    size_t bytes = (size_t)size * sizeof(int);
+    void *ptr = MAP_FAILED;
+
+    if (gShmData)
+    {
+        // Named, so that the worker processes can map it too
+        snprintf(gShmDataName, sizeof(gShmDataName), "/MTFindProd.%d.%u", (int)getpid(), ++gShmDataGen);
+        int fd = shm_open(gShmDataName, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd == -1 || ftruncate(fd, bytes) == -1)
+        {
+            perror("shm_open failed");
+            exit(-1);
+        }
+        gDataBytes = bytes;
+        ptr = mmap(NULL, gDataBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED)
+        {
+            perror("mmap failed");
+            exit(-1);
+        }
+        if (gHugePages != HUGEPAGES_OFF && bytes >= HUGE_PAGE_SIZE)
+        {
+            madvise(ptr, gDataBytes, MADV_HUGEPAGE); // Only a hint, ignore failures
+        }
+        gData = ptr;
+        return;
+    }
+    if (gHugePages == HUGEPAGES_EXPLICIT)
+    {
+        gDataBytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        ptr = mmap(NULL, gDataBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            perror("mmap with MAP_HUGETLB failed, using regular pages");
+        }
+    }
+    if (ptr == MAP_FAILED)
+    {
+        gDataBytes = bytes;
+        ptr = mmap(NULL, gDataBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            perror("mmap failed");
+            exit(-1);
+        }
+        if (gHugePages == HUGEPAGES_THP && bytes >= HUGE_PAGE_SIZE)
+        {
+            madvise(ptr, gDataBytes, MADV_HUGEPAGE); // Only a hint, ignore failures
+        }
+    }
+    gData = ptr;
+}
+
+// Number of whole elements in the input file
+long long DataFileElements(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1)
+    {
+        perror("stat failed");
+        exit(-1);
+    }
+    return (long long)st.st_size / (long long)sizeof(int);
+}
+
+// An input is mapped whole only if it takes at most half of the physical memory,
+// otherwise the schemes would page it in from disk over and over
+bool DataFileFitsInRam(long long count)
+{
+    long long ram = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE);
+    return count * (long long)sizeof(int) <= ram / 2;
+}
+
+// Map the first size elements of the file as gData without copying them. The mapping
+// is private and writable so that indexForZero can be applied (only the page holding
+// it is copied) and it is populated up front so the schemes do not time disk reads
+void MapDataFile(const char *path, int size)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        perror("open failed");
+        exit(-1);
+    }
+    gDataBytes = (size_t)size * sizeof(int);
+    gData = mmap(NULL, gDataBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (gData == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(-1);
+    }
+    if (gHugePages == HUGEPAGES_THP && gDataBytes >= HUGE_PAGE_SIZE)
+    {
+        madvise(gData, gDataBytes, MADV_HUGEPAGE); // Only a hint, ignore failures
+    }
+    close(fd); // The mapping keeps the file open
+}
+
+void FreeData(void)
+{
+    if (gData != NULL)
+    {
+        munmap(gData, gDataBytes);
+        gData = NULL;
+        gDataInRange = false;
+        if (gShmData)
+        {
+            shm_unlink(gShmDataName); // The workers keep their mappings until the next segment
+        }
+    }
+    if (gPacked != NULL)
+    {
+        munmap(gPacked, gPackedBytes);
+        gPacked = NULL;
+    }
+    gStorage = STORAGE_INT32;
+}
+
+// One fused pass on the pool
+void DataRange(int size, int64_t *range)
+{
+    Reducer reducers[MAX_REDUCERS];
+    Job job;
+
+    CalculateIndices(size, gThreadCount, job.indices);
+    RunReductions(reducers, ParseReducers("min,max", reducers), &job, range);
+}
+
+// Input files are checked with this before any scheme runs: the SIMD product kernels,
+// the histogram and the discrete-log table all rely on the range
+bool DataInRange(int size)
+{
+    int64_t range[2];
+
+    DataRange(size, range);
+    return range[0] >= 0 && range[1] <= MAX_RANDOM_NUMBER;
+}
+
+// Narrowest layout that holds every one of the first size elements of gData, from their
+// minimum and maximum
+StorageMode StorageForRange(int size)
+{
+    int64_t range[2];
+
+    DataRange(size, range);
+    if (range[0] < 0 || range[1] > UINT16_MAX)
+    {
+        return STORAGE_INT32;
+    }
+    return (range[1] < (1 << 12)) ? STORAGE_PACKED12 : STORAGE_UINT16;
+}
+
+// Copy the first size elements of gData into gPacked in the given layout and switch the
+// schemes to it. Both buffers are mapped while the workers pack their divisions; gData is
+// unmapped afterwards unless keepInt32, for the engines that only read int32 elements
+void PackData(int size, StorageMode mode, bool keepInt32)
+{
+    size_t bytes = (mode == STORAGE_UINT16) ? (size_t)size * sizeof(uint16_t) : ((size_t)size + 1) / 2 * 3;
+    Job job;
+
+    if (mode == STORAGE_INT32)
+    {
+        return;
+    }
+    gPackedBytes = bytes + PACKED_PAD;
+    gPacked = mmap(NULL, gPackedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (gPacked == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(-1);
+    }
+    if (gHugePages != HUGEPAGES_OFF && gPackedBytes >= HUGE_PAGE_SIZE)
+    {
+        madvise(gPacked, gPackedBytes, MADV_HUGEPAGE); // Only a hint, ignore failures
+    }
+
+    gStorage = mode;
+    CalculateIndices(size, gThreadCount, job.indices);
+    job.routine = ThPackData;
+    PoolSubmit(&job);
+    PoolJoin();
+
+    if (CpuIsaLevel() >= 2)
+    {
+        gPackedKernel = (mode == STORAGE_UINT16) ? ProdKernelAvx2U16 : ProdKernelAvx2U12;
+    }
+    else
+    {
+        gPackedKernel = (mode == STORAGE_UINT16) ? ProdKernelScalarU16 : ProdKernelScalarU12;
+    }
+    if (!keepInt32)
+    {
+        munmap(gData, gDataBytes);
+        gData = NULL;
+    }
+}
+
+void *ThPackData(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+
+    if (gStorage == STORAGE_UINT16)
+    {
+        uint16_t *out = (uint16_t *)gPacked;
+        for (int i = data->start; i <= data->end; i++)
+        {
+            out[i] = (uint16_t)gData[i];
+        }
+        return NULL;
+    }
+    // Two elements share a byte, so each worker packs the pairs that start in its division;
+    // only the last division can end in half a pair
+    bool last = (data->id == gThreadCount - 1);
+    for (long i = (data->start + 1) & ~1L; i <= data->end; i += 2)
+    {
+        int low = gData[i];
+        int high = (i < data->end || !last) ? gData[i + 1] : 0;
+        uint8_t *p = gPacked + 3 * (i >> 1);
+        p[0] = (uint8_t)low;
+        p[1] = (uint8_t)((low >> 8) | (high << 4));
+        p[2] = (uint8_t)(high >> 4);
+    }
+    return NULL;
+}
+
+// Element i in the current layout
+int GetElement(long i)
+{
+    if (gStorage == STORAGE_INT32)
+    {
+        return gData[i];
+    }
+    return PackedElement(gPacked, i, (gStorage == STORAGE_UINT16) ? 16 : 12);
+}
+
+// Set element i in gData (if it is mapped) and in gPacked (if the layout is compact)
+void SetElement(long i, int value)
+{
+    if (gData != NULL)
+    {
+        gData[i] = value;
+    }
+    if (gStorage == STORAGE_UINT16)
+    {
+        ((uint16_t *)gPacked)[i] = (uint16_t)value;
+    }
+    else if (gStorage == STORAGE_PACKED12)
+    {
+        uint8_t *p = gPacked + 3 * (i >> 1);
+        if (i & 1)
+        {
+            p[1] = (uint8_t)((p[1] & 0x0F) | (value << 4));
+            p[2] = (uint8_t)(value >> 4);
+        }
+        else
+        {
+            p[0] = (uint8_t)value;
+            p[1] = (uint8_t)((p[1] & 0xF0) | (value >> 8));
+        }
+    }
+}
+
+// Write a function that fills the gData array with random numbers between 1 and MAX_RANDOM_NUMBER
+// If indexForZero is valid and non-negative, set the value at that index to zero
+// The workers fill the same divisions they later multiply (CalculateIndices with the
+// same thread count), so the first touch of each page happens on the thread that reads
+// it and the kernel places the page on that thread's NUMA node
+void GenerateInput(int size, int indexForZero)
+{
+    Job job;
+
+    CalculateIndices(size, gThreadCount, job.indices);
+    job.routine = ThGenerateInput;
+    PoolSubmit(&job);
+    PoolJoin();
+
+    if (indexForZero >= 0 && indexForZero < size)
+    {
+        gData[indexForZero] = 0; // Insert zero at the specified index if valid
+    }
+    gDataInRange = true;
+}
+
+void *ThGenerateInput(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    for (int i = data->start; i <= data->end; i++)
+    {
+        gData[i] = GetCounterRand(i);
+    }
+    return NULL;
+}
+
+// Have each worker write its own division once, so that a serial generator that runs
+// afterwards finds the pages already placed on the workers' NUMA nodes
+void PlaceData(int size)
+{
+    Job job;
+
+    CalculateIndices(size, gThreadCount, job.indices);
+    job.routine = ThPlaceData;
+    PoolSubmit(&job);
+    PoolJoin();
+}
+
+void *ThPlaceData(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    memset(&gData[data->start], 0, (size_t)(data->end - data->start + 1) * sizeof(int));
+    return NULL;
+}
+
+// Serial generator with the C library's rand(), which gives the products the assignment's
+// sample runs show. rand() is not thread-safe, so this cannot be parallelized
+void GenerateInputRand(int size, int indexForZero)
+{
+    srand(RANDOM_SEED); // Set a fixed seed for the random number generator
+    for (int i = 0; i < size; i++)
+    {
+        gData[i] = (rand() % MAX_RANDOM_NUMBER) + 1;
+    }
+    if (indexForZero >= 0 && indexForZero < size)
+    {
+        gData[indexForZero] = 0; // Insert zero at the specified index if valid
+    }
+    gDataInRange = true;
+}
+
+// Write a function that calculates the right indices to divide the array into thrdCnt equal divisions
+// For each division i, indices[i][0] should be set to the division number i,
+// indices[i][1] should be set to the start index, and indices[i][2] should be set to the end index
+void CalculateIndices(int arraySize, int thrdCnt, int indices[MAX_THREADS][3])
+{
+    int chunk_size = arraySize / thrdCnt;
+    for (int i = 0; i < thrdCnt; i++)
+    {
+        indices[i][0] = i;                                                                       // Store division number
+        indices[i][1] = i * chunk_size;                                                          // Start index
+        indices[i][2] = (i == thrdCnt - 1) ? (arraySize - 1) : (indices[i][1] + chunk_size - 1); // End index
+    }
+}
+
+// Get a random number in the range [x, y]
+int GetRand(int x, int y)
+{
+    int r = rand();
+    r = x + r % (y - x + 1);
+    return r;
+}
+
+// Function to get the current time in nanoseconds
+// CLOCK_MONOTONIC does not jump with wall clock adjustments
+long GetCurrentTime(void)
+{
+    return NowNs();
+}
 
-volatile int gThreadCount;              // Number of threads
-volatile int gDoneThreadCount;          // Number of threads that are done at a certain point. Whenever a thread is done, it increments this. Used with the semaphore-based solution
-volatile int gThreadProd[MAX_THREADS];  // The modular product for each array division that a single thread is responsible for
-volatile bool gThreadDone[MAX_THREADS]; // Is this thread done? Used when the parent is continually checking on child threads
-// Modify the declaration of found_zero
-volatile atomic_bool found_zero = false; // Shared flag indicating if zero is found
+void SetTime(void)
+{
+    gRefTime = GetCurrentTime();
+}
 
-// Semaphores
-sem_t completed;              // To notify parent that all threads have completed or one of them found a zero
-sem_t mutex;                  // Binary semaphore to protect the shared variable gDoneThreadCount
-pthread_attr_t *thread_attrs; // Array to store thread attributes
-
-int SqFindProd(int size);                   // Sequential FindProduct (no threads) computes the product of all the elements in the array mod NUM_LIMIT
-void *ThFindProd(void *param);              // Thread FindProduct but without semaphores
-void *ThFindProdWithSemaphore(void *param); // Thread FindProduct with semaphores
-int ComputeTotalProduct();                  // Multiply the division products to compute the total modular product
-void InitSharedVars();
-void GenerateInput(int size, int indexForZero);                                 // Generate the input array
-void CalculateIndices(int arraySize, int thrdCnt, int indices[MAX_THREADS][3]); // Calculate the indices to divide the array into T divisions, one division per thread
-int GetRand(int min, int max);                                                  // Get a random number between min and max
-
-volatile void SetTime(void);
-volatile long GetTime(void);
-volatile long GetCurrentTime(); // Function to get the current time in milliseconds
-
-// Declare global variables and structures
-int array_size, num_threads, zero_index; // Input parameters
-int final_product = 1;                   // Global final product
-
-pthread_t *threads;              // Array to store thread IDs
-sem_t semaphore;                 // Semaphore for synchronization
-pthread_mutex_t lock;            // Mutex for protecting shared variables
-volatile int busy_wait_flag = 0; // Flag for busy-waiting scheme
+long GetTime(void)
+{
+    return GetCurrentTime() - gRefTime;
+}
 
-// Struct to store thread-specific data
-typedef struct
+uint32_t ComputeTotalProduct()
 {
-    int id;     // Thread ID
-    int start;  // Start index of the assigned array segment
-    int end;    // End index of the assigned array segment
-    int result; // Thread's computed product
-} ThreadData;
+    uint32_t prod = 1;
+    for (int i = 0; i < gThreadCount; i++)
+    {
+        prod = ModMul(prod, atomic_load_explicit(&gThreadSlots[i].prod, memory_order_acquire), gMod);
+    }
+    return prod;
+}
 
-ThreadData *thread_data; // Array to hold thread-specific data
-int (*indices)[3];       // 2D array to store thread division indices
+// Create threadCount workers that wait for jobs posted with PoolSubmit()
+void PoolInit(int threadCount)
+{
+    gPool.size = threadCount;
+    gPool.generation = 0;
+    gPool.busy = 0;
+    gPool.quit = false;
+    gPool.routine = NULL;
+    pthread_mutex_init(&gPool.lock, NULL);
+    pthread_cond_init(&gPool.start, NULL);
+    pthread_cond_init(&gPool.idle, NULL);
 
-// Function declarations
-void *ThFindProd(void *arg);                       // Thread function for computing modular product
-void initialize_variables(int argc, char *argv[]); // Function to parse input and initialize global variables
-void create_threads();                             // Function to create threads
-void wait_for_threads();                           // Function to wait for all threads using pthread_join
+    for (int i = 0; i < threadCount; i++)
+    {
+        pthread_attr_init(&gPool.attr[i]);
+        if (gAffinityCount > 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(gAffinityCpus[i % gAffinityCount], &set);
+            pthread_attr_setaffinity_np(&gPool.attr[i], sizeof(set), &set);
+        }
+        gPool.data[i].id = i;
+        if (pthread_create(&gPool.tid[i], &gPool.attr[i], PoolWorker, &gPool.data[i]) != 0)
+        {
+            fprintf(stderr, "Failed to create worker thread %d\n", i);
+            exit(-1);
+        }
+    }
+}
 
-int main(int argc, char *argv[])
+// Read one integer from a sysfs file, or fallback if it cannot be read
+static int ReadSysfsInt(const char *path, int fallback)
 {
-    pthread_t tid[MAX_THREADS];
-    pthread_attr_t attr[MAX_THREADS];
-    int indices[MAX_THREADS][3];
-    int i, indexForZero, arraySize, prod;
+    FILE *f = fopen(path, "r");
+    int value;
 
-    // Code for parsing and checking command-line arguments
-    if (argc != 4)
+    if (f == NULL)
     {
-        fprintf(stderr, "Invalid number of arguments!\n");
-        exit(-1);
+        return fallback;
     }
-    if ((arraySize = atoi(argv[1])) <= 0 || arraySize > MAX_SIZE)
+    if (fscanf(f, "%d", &value) != 1)
     {
-        fprintf(stderr, "Invalid Array Size\n");
-        exit(-1);
+        value = fallback;
     }
-    gThreadCount = atoi(argv[2]);
-    if (gThreadCount > MAX_THREADS || gThreadCount <= 0)
+    fclose(f);
+    return value;
+}
+
+// List the CPUs in this process's affinity mask with their socket, core and NUMA node.
+// The node is the nodeN link in the CPU's sysfs directory; a kernel without NUMA
+// support has none, and the socket is used as the domain instead
+int ReadCpuTopology(CpuInfo *cpus)
+{
+    cpu_set_t allowed;
+    int count = 0;
+    char path[128];
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
     {
-        fprintf(stderr, "Invalid Thread Count\n");
+        perror("sched_getaffinity failed");
         exit(-1);
     }
-    indexForZero = atoi(argv[3]);
-    if (indexForZero < -1 || indexForZero >= arraySize)
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
     {
-        fprintf(stderr, "Invalid index for zero!\n");
-        exit(-1);
-    }
-
-    GenerateInput(arraySize, indexForZero);
+        if (!CPU_ISSET(cpu, &allowed))
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        int package = ReadSysfsInt(path, 0);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        int core = ReadSysfsInt(path, cpu);
+        int node = -1;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+        DIR *dir = opendir(path);
+        if (dir != NULL)
+        {
+            struct dirent *entry;
+            while (node < 0 && (entry = readdir(dir)) != NULL)
+            {
+                sscanf(entry->d_name, "node%d", &node);
+            }
+            closedir(dir);
+        }
 
-    CalculateIndices(arraySize, gThreadCount, indices);
+        cpus[count].cpu = cpu;
+        cpus[count].domain = (node >= 0) ? node : package;
+        cpus[count].core = package * 65536 + core; // Core ids are only unique within a socket
+        count++;
+    }
+    return count;
+}
 
-    // Code for the sequential part
-    SetTime();
-    prod = SqFindProd(arraySize);
-    printf("Sequential multiplication completed in %ld ms. Product = %d\n", GetTime(), prod);
+static int CompareCpuCompact(const void *a, const void *b)
+{
+    const CpuInfo *x = a, *y = b;
+    if (x->domain != y->domain)
+        return x->domain - y->domain;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
 
-    // Threaded with parent waiting for all child threads
-    InitSharedVars();
-    SetTime();
+// Compact: the hardware threads of a core, then the cores of a node, then the next node.
+// Scatter: one hardware thread per core, taking the nodes in turn, and only then the
+// second hardware thread of each core, so that the first workers get the most memory
+// bandwidth and cache
+void SetupAffinity(const char *policy)
+{
+    static CpuInfo cpus[CPU_SETSIZE];
+    int count = ReadCpuTopology(cpus);
 
-    // Initialize threads and create them
-    pthread_mutex_init(&lock, NULL);
-    for (i = 0; i < gThreadCount; i++)
+    if (strcmp(policy, "compact") == 0 || strcmp(policy, "scatter") == 0)
     {
-        pthread_attr_init(&attr[i]);
-        ThreadData *data = (ThreadData *)malloc(sizeof(ThreadData));
-        data->id = i;
-        data->start = indices[i][1];
-        data->end = indices[i][2];
-        data->result = 1;
-        pthread_create(&tid[i], &attr[i], ThFindProd, data);
+        qsort(cpus, count, sizeof(CpuInfo), CompareCpuCompact);
+        gAffinityCount = count;
+        if (strcmp(policy, "compact") == 0)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                gAffinityCpus[i] = cpus[i].cpu;
+            }
+            return;
+        }
+
+        // In compact order, rank each CPU among the hardware threads of its core (smt)
+        // and its core among the cores of its node (slot)
+        static int smt[CPU_SETSIZE], slot[CPU_SETSIZE];
+        int maxSmt = 0, maxSlot = 0, filled = 0;
+        for (int i = 0; i < count; i++)
+        {
+            bool sameCore = i > 0 && cpus[i].domain == cpus[i - 1].domain && cpus[i].core == cpus[i - 1].core;
+            bool sameDomain = i > 0 && cpus[i].domain == cpus[i - 1].domain;
+            smt[i] = sameCore ? smt[i - 1] + 1 : 0;
+            slot[i] = sameCore ? slot[i - 1] : (sameDomain ? slot[i - 1] + 1 : 0);
+            maxSmt = (smt[i] > maxSmt) ? smt[i] : maxSmt;
+            maxSlot = (slot[i] > maxSlot) ? slot[i] : maxSlot;
+        }
+        for (int t = 0; t <= maxSmt; t++)
+        {
+            for (int c = 0; c <= maxSlot; c++)
+            {
+                for (int i = 0; i < count; i++) // Nodes in order
+                {
+                    if (smt[i] == t && slot[i] == c)
+                    {
+                        gAffinityCpus[filled++] = cpus[i].cpu;
+                    }
+                }
+            }
+        }
+        return;
     }
 
-    // Wait for all threads to complete
-    for (i = 0; i < gThreadCount; i++)
+    gAffinityCount = ParseCpuList(policy, gAffinityCpus);
+    for (int i = 0; i < gAffinityCount; i++)
     {
-        pthread_join(tid[i], NULL);
+        bool allowed = false;
+        for (int j = 0; j < count; j++)
+        {
+            allowed = allowed || cpus[j].cpu == gAffinityCpus[i];
+        }
+        if (!allowed)
+        {
+            fprintf(stderr, "CPU %d is not available to this process\n", gAffinityCpus[i]);
+            exit(-1);
+        }
     }
+}
 
-    prod = ComputeTotalProduct();
-    printf("Threaded multiplication with parent waiting for all children completed in %ld ms. Product = %d\n", GetTime(), prod);
-    // Multi-threaded with busy waiting
-    InitSharedVars();
-    atomic_store(&found_zero, false);
-
-    SetTime(); // Start timing before creating threads
+// Parse a CPU list in the sysfs cpulist format, e.g. "0,2,4-7"
+int ParseCpuList(const char *list, int *cpus)
+{
+    int count = 0;
+    const char *p = list;
 
-    // Create threads
-    for (i = 0; i < gThreadCount; i++)
+    while (*p != '\0')
     {
-        pthread_attr_init(&attr[i]);
-        ThreadData *data = (ThreadData *)malloc(sizeof(ThreadData));
-        data->id = i;
-        data->start = indices[i][1];
-        data->end = indices[i][2];
-        data->result = 1;
-        pthread_create(&tid[i], &attr[i], ThFindProd, data);
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end != p && *end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        if (end == p || (*end != ',' && *end != '\0') || first < 0 || last < first || last >= CPU_SETSIZE)
+        {
+            fprintf(stderr, "Invalid CPU list %s\n", list);
+            exit(-1);
+        }
+        for (long cpu = first; cpu <= last && count < CPU_SETSIZE; cpu++)
+        {
+            cpus[count++] = (int)cpu;
+        }
+        p = (*end == ',') ? end + 1 : end;
     }
+    return count;
+}
 
-    // Busy-wait loop
-    while (1)
+// Post a job to every worker. Each worker i runs job->routine on the division given
+// by job->indices[i]. Returns as soon as the workers have been woken up
+void PoolSubmit(const Job *job)
+{
+    pthread_mutex_lock(&gPool.lock);
+    while (gPool.busy > 0)
     {
-        pthread_mutex_lock(&lock);
-        bool done = (gDoneThreadCount >= gThreadCount || atomic_load(&found_zero));
-        pthread_mutex_unlock(&lock);
-
-        if (done)
-            break;
-
-        sched_yield();
+        pthread_cond_wait(&gPool.idle, &gPool.lock);
+    }
+    for (int i = 0; i < gPool.size; i++)
+    {
+        gPool.data[i].start = job->indices[i][1];
+        gPool.data[i].end = job->indices[i][2];
+        gPool.data[i].result = 1;
     }
+    gPool.routine = job->routine;
+    gPool.busy = gPool.size;
+    gPool.generation++;
+    pthread_cond_broadcast(&gPool.start);
+    pthread_mutex_unlock(&gPool.lock);
+}
 
-    // Cancel threads if zero found
-    if (atomic_load(&found_zero))
+// Wait until every worker has returned from the routine of the current job
+void PoolJoin(void)
+{
+    pthread_mutex_lock(&gPool.lock);
+    while (gPool.busy > 0)
     {
-        for (int i = 0; i < gThreadCount; i++)
-        {
-            pthread_cancel(tid[i]);
-        }
+        pthread_cond_wait(&gPool.idle, &gPool.lock);
     }
+    pthread_mutex_unlock(&gPool.lock);
+}
 
-    // Compute product
-    prod = found_zero ? 0 : ComputeTotalProduct();
-    printf("Threaded multiplication with parent continually checking on children completed in %ld ms. Product = %d\n", GetTime(), prod);
+// Let the current job finish, then stop and join all workers
+void PoolShutdown(void)
+{
+    PoolJoin();
+    pthread_mutex_lock(&gPool.lock);
+    gPool.quit = true;
+    pthread_cond_broadcast(&gPool.start);
+    pthread_mutex_unlock(&gPool.lock);
 
-    // Multi-threaded with busy waiting (Second Scheme)
-    InitSharedVars();
-    atomic_store(&found_zero, false);
+    for (int i = 0; i < gPool.size; i++)
+    {
+        pthread_join(gPool.tid[i], NULL);
+        pthread_attr_destroy(&gPool.attr[i]);
+    }
+    pthread_cond_destroy(&gPool.idle);
+    pthread_cond_destroy(&gPool.start);
+    pthread_mutex_destroy(&gPool.lock);
+}
 
-    SetTime(); // Start timing before thread creation
+// Worker loop: sleep until a new job generation is posted, run the job routine on
+// this worker's ThreadData, and report back so the parent can join the job
+void *PoolWorker(void *param)
+{
+    ThreadData *data = (ThreadData *)param;
+    unsigned long seen = 0;
 
-    // Create threads
-    for (i = 0; i < gThreadCount; i++)
+    if (gPerf)
     {
-        pthread_attr_init(&attr[i]);
-        ThreadData *data = (ThreadData *)malloc(sizeof(ThreadData));
-        data->id = i;
-        data->start = indices[i][1];
-        data->end = indices[i][2];
-        data->result = 1;
-        pthread_create(&tid[i], &attr[i], ThFindProd, data);
+        PerfOpen(data->id);
     }
-
-    // Busy-wait loop (no semaphores)
+    pthread_mutex_lock(&gPool.lock);
     while (1)
     {
-        pthread_mutex_lock(&lock);
-        bool done = (gDoneThreadCount >= gThreadCount || atomic_load(&found_zero));
-        pthread_mutex_unlock(&lock);
-
-        if (done)
+        while (gPool.generation == seen && !gPool.quit)
+        {
+            pthread_cond_wait(&gPool.start, &gPool.lock);
+        }
+        if (gPool.quit)
+        {
             break;
+        }
+        seen = gPool.generation;
+        void *(*routine)(void *) = gPool.routine;
+        pthread_mutex_unlock(&gPool.lock);
 
-        sched_yield(); // Yield CPU to avoid hogging resources
-    }
+        PerfStart(data->id);
+        routine(data);
+        PerfStop(data->id);
 
-    // Cancel all threads if zero found
-    if (atomic_load(&found_zero))
-    {
-        for (int i = 0; i < gThreadCount; i++)
+        pthread_mutex_lock(&gPool.lock);
+        if (--gPool.busy == 0)
         {
-            pthread_cancel(tid[i]);
+            pthread_cond_broadcast(&gPool.idle);
         }
     }
-
-    prod = found_zero ? 0 : ComputeTotalProduct();
-    printf("Threaded multiplication with parent continually checking on children completed in %ld ms. Product = %d\n", GetTime(), prod);
+    pthread_mutex_unlock(&gPool.lock);
+    if (gPerf)
+    {
+        PerfClose(data->id);
+    }
+    return NULL;
 }
 
-// Write a regular sequential function to multiply all the elements in gData mod NUM_LIMIT
-// REMEMBER TO MOD BY NUM_LIMIT AFTER EACH MULTIPLICATION TO PREVENT YOUR PRODUCT VARIABLE FROM OVERFLOWING
-int SqFindProd(int size)
+void ProcPoolInit(int count)
 {
-    int product = 1;
-    for (int i = 0; i < size; i++)
+    if (gProcs.header == NULL)
     {
-        if (gData[i] == 0)
+        gProcs.header = mmap(NULL, sizeof(ProcHeader), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (gProcs.header == MAP_FAILED)
         {
-            return 0; // Terminate early if zero is found
+            perror("mmap failed");
+            exit(-1);
         }
-        product = (product * gData[i]) % NUM_LIMIT; // Compute product mod NUM_LIMIT
     }
-    return product;
-}
+    gProcs.header->quit = false;
+    gProcs.header->dataGen = 0; // The new workers map gData on their first job
+    ProcReset();
+    gProcs.size = count;
+    gProcs.startSeq = atomic_load(&gProcs.header->jobSeq);
 
-// Write a thread function that computes the product of all the elements in one division of the array mod NUM_LIMIT
-// REMEMBER TO MOD BY NUM_LIMIT AFTER EACH MULTIPLICATION TO PREVENT YOUR PRODUCT VARIABLE FROM OVERFLOWING
-// When it is done, this function should store the product in gThreadProd[threadNum] and set gThreadDone[threadNum] to true
-void *ThFindProd(void *param)
-{
-    ThreadData *data = (ThreadData *)param;
-    int product = 1;
-    for (int i = data->start; i <= data->end; i++)
+    fflush(stdout); // Nothing buffered may be inherited
+    for (int i = 0; i < count; i++)
     {
-        // Check if another thread found a zero (atomic load)
-        if (atomic_load(&found_zero))
+        pid_t pid = fork();
+        if (pid == -1)
         {
-            pthread_exit(NULL);
+            perror("fork failed");
+            exit(-1);
         }
-
-        if (gData[i] == 0)
+        if (pid == 0)
         {
-            // Set found_zero atomically
-            atomic_store(&found_zero, true);
-            pthread_mutex_lock(&lock);
-            gThreadProd[data->id] = 0;
-            pthread_mutex_unlock(&lock);
-            pthread_exit(NULL);
+            ProcWorker(i);
         }
-        product = (product * gData[i]) % NUM_LIMIT;
+        gProcs.pid[i] = pid;
     }
-
-    pthread_mutex_lock(&lock);
-    gThreadProd[data->id] = product;
-    gDoneThreadCount++;
-    pthread_mutex_unlock(&lock);
-    pthread_exit(NULL);
 }
 
-// Write a thread function that computes the product of all the elements in one division of the array mod NUM_LIMIT
-// REMEMBER TO MOD BY NUM_LIMIT AFTER EACH MULTIPLICATION TO PREVENT YOUR PRODUCT VARIABLE FROM OVERFLOWING
-// When it is done, this function should store the product in gThreadProd[threadNum]
-// If the product value in this division is zero, this function should post the "completed" semaphore
-// If the product value in this division is not zero, this function should increment gDoneThreadCount and
-// post the "completed" semaphore if it is the last thread to be done
-// Don't forget to protect access to gDoneThreadCount with the "mutex" semaphore
-void *ThFindProdWithSemaphore(void *param)
+// Clear the results of the last job
+void ProcReset(void)
 {
-    ThreadData *data = (ThreadData *)param;
-    int product = 1;
+    ProcHeader *h = gProcs.header;
 
-    for (int i = data->start; i <= data->end; i++)
+    for (int i = 0; i < MAX_THREADS; i++)
     {
-        if (gData[i] == 0)
-        {
-            sem_wait(&mutex);
-            gThreadProd[data->id] = 0; // Explicitly set to zero
-            found_zero = true;
-            sem_post(&semaphore);
-            sem_post(&mutex);
-
-            pthread_exit(NULL);
-        }
-        product = (product * gData[i]) % NUM_LIMIT;
+        atomic_store_explicit(&h->slots[i].prod, 1, memory_order_relaxed);
     }
+    atomic_store(&h->foundZero, false);
+    atomic_store(&h->doneWord, 0);
+}
 
-    sem_wait(&mutex);
-    gThreadProd[data->id] = product;
-    gDoneThreadCount++;
-    if (gDoneThreadCount == gThreadCount)
+void ProcPoolShutdown(void)
+{
+    if (gProcs.size == 0)
     {
-        sem_post(&semaphore); // Notify parent if all threads done
+        return;
     }
-    sem_post(&mutex);
-
-    pthread_exit(NULL);
+    gProcs.header->quit = true;
+    atomic_fetch_add(&gProcs.header->jobSeq, 1);
+    syscall(SYS_futex, &gProcs.header->jobSeq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    for (int i = 0; i < gProcs.size; i++)
+    {
+        waitpid(gProcs.pid[i], NULL, 0);
+    }
+    gProcs.size = 0;
 }
 
-void InitSharedVars()
+// A worker process: wait for a job, map the gData segment if it is a new one, multiply
+// its division PROD_BLOCK elements at a time (stopping when another worker found a zero)
+// and report. Only the forking thread exists here, so nothing of the pool is touched
+void ProcWorker(int id)
 {
-    int i;
+    ProcHeader *h = gProcs.header;
+    unsigned seen = gProcs.startSeq, gen = 0;
+    const int *data = NULL;
+    size_t bytes = 0;
 
-    for (i = 0; i < gThreadCount; i++)
+    prctl(PR_SET_PDEATHSIG, SIGKILL); // Do not outlive the parent
+    if (gAffinityCount > 0)
     {
-        gThreadDone[i] = false;
-        gThreadProd[i] = 1;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(gAffinityCpus[id % gAffinityCount], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    while (1)
+    {
+        unsigned seq;
+        while ((seq = atomic_load(&h->jobSeq)) == seen)
+        {
+            syscall(SYS_futex, &h->jobSeq, FUTEX_WAIT, seen, NULL, NULL, 0);
+        }
+        seen = seq;
+        if (h->quit)
+        {
+            _exit(0);
+        }
+        if (h->dataGen != gen)
+        {
+            int fd = shm_open(h->dataName, O_RDONLY, 0);
+            if (data != NULL)
+            {
+                munmap((void *)data, bytes);
+            }
+            bytes = h->dataBytes;
+            data = (fd == -1) ? MAP_FAILED : mmap(NULL, bytes, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                _exit(1); // The parent notices and gives up
+            }
+            close(fd);
+            gen = h->dataGen;
+        }
+
+        uint32_t product = 1;
+        bool zero = false;
+        for (int i = h->indices[id][1]; i <= h->indices[id][2] && !zero; i += PROD_BLOCK)
+        {
+            if (atomic_load(&h->foundZero))
+            {
+                break; // The product is zero, what this worker has does not matter
+            }
+            int n = (h->indices[id][2] - i + 1 < PROD_BLOCK) ? (h->indices[id][2] - i + 1) : PROD_BLOCK;
+            uint32_t blockProd = gProdKernel(data + i, n);
+            if (blockProd == 0)
+            {
+                zero = true;
+                atomic_store(&h->foundZero, true);
+            }
+            product = ModMul(product, blockProd, gMod);
+        }
+        atomic_store_explicit(&h->slots[id].prod, product, memory_order_release);
+
+        // Wake the parent for the first zero and for the last worker
+        if (zero && !(atomic_fetch_or(&h->doneWord, DONE_WORD_ZERO) & DONE_WORD_ZERO))
+        {
+            syscall(SYS_futex, &h->doneWord, FUTEX_WAKE, 1, NULL, NULL, 0);
+        }
+        if (((atomic_fetch_add(&h->doneWord, 1) + 1) & ~DONE_WORD_ZERO) == (unsigned)gProcs.size)
+        {
+            syscall(SYS_futex, &h->doneWord, FUTEX_WAKE, 1, NULL, NULL, 0);
+        }
     }
-    gDoneThreadCount = 0;
 }
 
-// Write a function that fills the gData array with random numbers between 1 and MAX_RANDOM_NUMBER
-// If indexForZero is valid and non-negative, set the value at that index to zero
-void GenerateInput(int size, int indexForZero)
+// Open the counters of the calling thread on any CPU. The kernel part is counted if
+// perf_event_paranoid allows it, otherwise only user space. An event the machine does
+// not have (e.g. in a VM without a virtual PMU) is left out and shown as n/a
+void PerfOpen(int slot)
 {
-    srand(RANDOM_SEED); // Set a fixed seed for the random number generator
-    for (int i = 0; i < size; i++)
+    static const struct
     {
-        gData[i] = (rand() % MAX_RANDOM_NUMBER) + 1;
-    }
-    if (indexForZero >= 0 && indexForZero < size)
+        uint32_t type;
+        uint64_t config;
+    } events[PERF_EVENT_COUNT] = {
+        [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        [PERF_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        [PERF_CONTEXT_SWITCHES] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    };
+    PerfCounters *pc = &gPerfCounters[slot];
+
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
     {
-        gData[indexForZero] = 0; // Insert zero at the specified index if valid
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[e].type;
+        attr.config = events[e].config;
+        attr.disabled = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc->fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (pc->fd[e] == -1 && (errno == EACCES || errno == EPERM))
+        {
+            attr.exclude_kernel = 1;
+            pc->fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        pc->count[e] = 0;
     }
 }
 
-// Write a function that calculates the right indices to divide the array into thrdCnt equal divisions
-// For each division i, indices[i][0] should be set to the division number i,
-// indices[i][1] should be set to the start index, and indices[i][2] should be set to the end index
-void CalculateIndices(int arraySize, int thrdCnt, int indices[MAX_THREADS][3])
+void PerfClose(int slot)
 {
-    int chunk_size = arraySize / thrdCnt;
-    for (int i = 0; i < thrdCnt; i++)
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
     {
-        indices[i][0] = i;                                                                       // Store division number
-        indices[i][1] = i * chunk_size;                                                          // Start index
-        indices[i][2] = (i == thrdCnt - 1) ? (arraySize - 1) : (indices[i][1] + chunk_size - 1); // End index
+        if (gPerfCounters[slot].fd[e] != -1)
+        {
+            close(gPerfCounters[slot].fd[e]);
+            gPerfCounters[slot].fd[e] = -1;
+        }
     }
 }
 
-// Get a random number in the range [x, y]
-int GetRand(int x, int y)
+void PerfStart(int slot)
 {
-    int r = rand();
-    r = x + r % (y - x + 1);
-    return r;
+    if (!gPerf)
+    {
+        return;
+    }
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        if (gPerfCounters[slot].fd[e] != -1)
+        {
+            ioctl(gPerfCounters[slot].fd[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(gPerfCounters[slot].fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
 }
 
-// Function to get the current time in milliseconds
-long GetCurrentTime(void)
+// If the PMU was multiplexed between more events than it has counters, the count is
+// scaled up by the fraction of the time the event was actually counted
+void PerfStop(int slot)
 {
-    struct timeval tv;
-    if (gettimeofday(&tv, NULL) != 0)
+    if (!gPerf)
+    {
+        return;
+    }
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
     {
-        perror("gettimeofday failed");
-        exit(EXIT_FAILURE);
+        uint64_t value[3]; // Count, time enabled, time running
+        int fd = gPerfCounters[slot].fd[e];
+
+        if (fd == -1)
+        {
+            continue;
+        }
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, value, sizeof(value)) == sizeof(value) && value[2] > 0)
+        {
+            gPerfCounters[slot].count[e] += (value[2] < value[1]) ? (uint64_t)((double)value[0] * value[1] / value[2]) : value[0];
+        }
     }
-    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
-void SetTime(void)
+void PerfReset(void)
 {
-    gRefTime = GetCurrentTime();
+    for (int slot = 0; slot <= PERF_PARENT; slot++)
+    {
+        memset(gPerfCounters[slot].count, 0, sizeof(gPerfCounters[slot].count));
+    }
 }
 
-long GetTime(void)
+static void PrintPerfRow(const char *label, const PerfCounters *pc)
 {
-    return GetCurrentTime() - gRefTime;
+    char text[PERF_EVENT_COUNT][24];
+
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        if (pc->fd[e] == -1)
+        {
+            snprintf(text[e], sizeof(text[e]), "n/a");
+        }
+        else
+        {
+            snprintf(text[e], sizeof(text[e]), "%llu", (unsigned long long)pc->count[e]);
+        }
+    }
+    char ipc[16] = "n/a";
+    if (pc->fd[PERF_CYCLES] != -1 && pc->fd[PERF_INSTRUCTIONS] != -1 && pc->count[PERF_CYCLES] > 0)
+    {
+        snprintf(ipc, sizeof(ipc), "%.2f", (double)pc->count[PERF_INSTRUCTIONS] / pc->count[PERF_CYCLES]);
+    }
+    printf("    %-9s %14s %14s %6s %12s %13s %8s\n", label, text[PERF_CYCLES], text[PERF_INSTRUCTIONS], ipc,
+           text[PERF_LLC_MISSES], text[PERF_BRANCH_MISSES], text[PERF_CONTEXT_SWITCHES]);
 }
 
-int ComputeTotalProduct()
+// Print the counts since the last PerfReset(): the parent's, and with workers set also
+// every worker's and their sum. Waits for the workers first, as they stop their
+// counters only after notifying the parent
+void PrintPerfCounters(bool workers)
 {
-    int prod = 1;
-    for (int i = 0; i < gThreadCount; i++)
+    PerfCounters total;
+
+    printf("    %-9s %14s %14s %6s %12s %13s %8s\n", "counters", "cycles", "instructions", "IPC", "LLC-misses",
+           "branch-misses", "cs");
+    PrintPerfRow("parent", &gPerfCounters[PERF_PARENT]);
+    if (!workers)
     {
-        prod = (prod * gThreadProd[i]) % NUM_LIMIT;
+        return;
     }
-    return prod;
-}
\ No newline at end of file
+    PoolJoin();
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < gPool.size; i++)
+    {
+        char label[16];
+
+        snprintf(label, sizeof(label), "thread %d", i);
+        PrintPerfRow(label, &gPerfCounters[i]);
+        for (int e = 0; e < PERF_EVENT_COUNT; e++)
+        {
+            total.count[e] += gPerfCounters[i].count[e];
+            total.fd[e] = (gPerfCounters[i].fd[e] == -1) ? -1 : 0; // Unavailable on one thread, unavailable on all
+        }
+    }
+    PrintPerfRow("workers", &total);
+}
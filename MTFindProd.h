@@ -0,0 +1,60 @@
+/*
+ * MTFindProd.h
+ *
+ * Library interface of the MTFindProd product engine. Build the engine without its
+ * main() and link it into the caller:
+ *    gcc -O3 -DMTFP_LIBRARY -c MTFindProd.c -o MTFindProd.o
+ *    gcc -O3 caller.c MTFindProd.o -o caller -lpthread -lm
+ *
+ * MtfpInit() starts the worker threads once. Batches of arrays are then submitted
+ * without creating any thread: the arrays go to an internal queue the workers serve,
+ * small arrays packed together so that many of them share one dispatch, and large ones
+ * cut into pieces that several workers multiply. Each product is written to the
+ * caller's results and handed to the callback, if any, on the worker thread that
+ * finished the array; the batch can be polled or waited for.
+ *
+ * Elements must lie in [0, MTFP_MAX_ELEMENT], which the SIMD kernels rely on for exact
+ * results. The arrays and results must stay valid until the batch is done. Only the
+ * Mtfp* names below are exported. MTFindProdLibTest.c is a minimal caller that checks
+ * the products.
+ */
+
+#ifndef MTFINDPROD_H
+#define MTFINDPROD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MTFP_MAX_ELEMENT 3000 // Largest element value the kernels accept
+
+// One array to multiply
+typedef struct
+{
+    const int *data;
+    int length;
+} MtfpArray;
+
+// Called once per array, on a worker thread, with the index of the array in its batch
+typedef void (*MtfpCallback)(void *user, int index, uint32_t product);
+
+typedef struct MtfpBatch MtfpBatch;
+
+// Start threads workers computing products mod modulus (2 <= modulus < 2^32). Returns 0,
+// or -1 if the arguments are invalid or the engine is already running
+int MtfpInit(int threads, uint32_t modulus);
+
+// Queue count arrays. The product of arrays[i] mod the modulus goes to results[i] (if
+// results is not NULL) and to callback (if not NULL). Returns the batch handle, or NULL
+// if the engine is not running (before MtfpInit or after MtfpShutdown), count is
+// negative, an array is NULL or has a negative length, results and callback are both
+// NULL, or memory runs out. Nothing is queued then
+MtfpBatch *MtfpSubmit(const MtfpArray *arrays, int count, uint32_t *results, MtfpCallback callback, void *user);
+
+bool MtfpPoll(MtfpBatch *batch);    // Whether every array of the batch is done
+void MtfpWait(MtfpBatch *batch);    // Block until every array of the batch is done
+void MtfpRelease(MtfpBatch *batch); // Free a batch that is done (NULL is ignored)
+
+// Finish the queued batches and stop the workers
+void MtfpShutdown(void);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * MTFindProdLibTest.c
+ *
+ * Minimal caller of the MTFindProd library (MTFindProd.h): submits batches of arrays of
+ * mixed lengths, waits for them by polling and by blocking, and checks every product
+ * and every callback against a plain sequential multiply-mod. Also checks that invalid
+ * submissions, and submissions while the engine is not running, are rejected. Returns 0
+ * if all checks pass.
+ *
+ * Compile and run with:
+ *    gcc -O3 -DMTFP_LIBRARY -c MTFindProd.c -o MTFindProd.o
+ *    gcc -O3 MTFindProdLibTest.c MTFindProd.o -o MTFindProdLibTest -lpthread -lm
+ *    ./MTFindProdLibTest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "MTFindProd.h"
+
+#define ARRAY_COUNT 200
+#define MAX_LENGTH 300000 // Above the library's pack size, so that some arrays are cut into pieces
+
+typedef struct
+{
+    uint32_t *products; // Product reported to the callback for each array
+    atomic_int calls;
+} CallbackLog;
+
+void LogProduct(void *user, int index, uint32_t product);
+uint32_t ReferenceProduct(const int *data, int length, uint32_t modulus);
+int RunBatches(int threads, uint32_t modulus, MtfpArray *arrays, int count);
+int CheckRejected(MtfpArray *arrays);
+
+int main()
+{
+    MtfpArray arrays[ARRAY_COUNT];
+    int failures = 0;
+
+    srand(7649);
+    for (int i = 0; i < ARRAY_COUNT; i++)
+    {
+        // Mostly small arrays, an empty one, and every tenth one large
+        int length = (i == 0) ? 0 : (i % 10 == 0) ? MAX_LENGTH - i : rand() % 2000 + 1;
+        int *data = malloc((length + 1) * sizeof(int));
+
+        if (data == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        for (int k = 0; k < length; k++)
+        {
+            data[k] = rand() % MTFP_MAX_ELEMENT + 1;
+        }
+        if (i % 37 == 5)
+        {
+            data[length / 2] = 0; // A few products are zero
+        }
+        arrays[i] = (MtfpArray){data, length};
+    }
+
+    failures += CheckRejected(arrays);
+    failures += RunBatches(4, 9973, arrays, ARRAY_COUNT);
+    failures += RunBatches(3, 1000000007, arrays, ARRAY_COUNT); // The library starts again after MtfpShutdown
+    failures += RunBatches(1, 4294967291u, arrays, ARRAY_COUNT);
+
+    for (int i = 0; i < ARRAY_COUNT; i++)
+    {
+        free((void *)arrays[i].data);
+    }
+    printf("%s\n", failures == 0 ? "All checks passed" : "Checks failed");
+    return failures == 0 ? 0 : 1;
+}
+
+void LogProduct(void *user, int index, uint32_t product)
+{
+    CallbackLog *log = (CallbackLog *)user;
+
+    log->products[index] = product;
+    atomic_fetch_add(&log->calls, 1);
+}
+
+// One dependent multiply-mod per element
+uint32_t ReferenceProduct(const int *data, int length, uint32_t modulus)
+{
+    uint64_t prod = 1 % modulus;
+
+    for (int i = 0; i < length; i++)
+    {
+        prod = prod * (uint64_t)data[i] % modulus;
+    }
+    return (uint32_t)prod;
+}
+
+// Multiply the arrays mod modulus as two batches, the first polled and the second waited
+// for, and return the number of wrong products
+int RunBatches(int threads, uint32_t modulus, MtfpArray *arrays, int count)
+{
+    uint32_t results[ARRAY_COUNT], logged[ARRAY_COUNT];
+    CallbackLog log = {logged, 0};
+    int half = count / 2, failures = 0;
+
+    if (MtfpInit(threads, modulus) != 0)
+    {
+        fprintf(stderr, "MtfpInit(%d, %u) failed\n", threads, modulus);
+        return 1;
+    }
+    MtfpBatch *polled = MtfpSubmit(arrays, half, results, LogProduct, &log);
+    MtfpBatch *waited = MtfpSubmit(arrays + half, count - half, results + half, NULL, NULL);
+    while (!MtfpPoll(polled))
+    {
+        sched_yield();
+    }
+    MtfpWait(waited);
+    MtfpRelease(polled);
+    MtfpRelease(waited);
+    MtfpShutdown();
+
+    if (atomic_load(&log.calls) != half)
+    {
+        fprintf(stderr, "Modulus %u: %d callbacks for %d arrays\n", modulus, atomic_load(&log.calls), half);
+        failures++;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t expected = ReferenceProduct(arrays[i].data, arrays[i].length, modulus);
+
+        if (results[i] != expected || (i < half && logged[i] != expected))
+        {
+            fprintf(stderr, "Modulus %u, array %d of %d elements: product %u, expected %u\n", modulus, i,
+                    arrays[i].length, results[i], expected);
+            failures++;
+        }
+    }
+    printf("Modulus %u with %d thread%s: %d arrays checked\n", modulus, threads, threads == 1 ? "" : "s", count);
+    return failures;
+}
+
+// Submissions that no worker could serve, or with invalid arguments, must return NULL
+// instead of queueing a batch MtfpWait would block on forever. Returns the number of
+// accepted ones
+int CheckRejected(MtfpArray *arrays)
+{
+    uint32_t results[2];
+    MtfpArray bad[2] = {arrays[1], {NULL, 5}};
+    MtfpArray negative = {arrays[1].data, -1};
+    int failures = 0;
+
+    failures += MtfpSubmit(arrays, 2, results, NULL, NULL) != NULL; // Before MtfpInit
+    if (MtfpInit(2, 9973) != 0)
+    {
+        fprintf(stderr, "MtfpInit(2, 9973) failed\n");
+        return failures + 1;
+    }
+    failures += MtfpSubmit(arrays, -1, results, NULL, NULL) != NULL;
+    failures += MtfpSubmit(NULL, 2, results, NULL, NULL) != NULL;
+    failures += MtfpSubmit(arrays, 2, NULL, NULL, NULL) != NULL; // The products would go nowhere
+    failures += MtfpSubmit(bad, 2, results, NULL, NULL) != NULL;
+    failures += MtfpSubmit(&negative, 1, results, NULL, NULL) != NULL;
+    MtfpShutdown();
+    failures += MtfpSubmit(arrays, 2, results, NULL, NULL) != NULL; // After MtfpShutdown
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d invalid submissions were accepted\n", failures);
+    }
+    else
+    {
+        printf("Invalid submissions rejected\n");
+    }
+    return failures;
+}
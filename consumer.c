@@ -14,11 +14,43 @@ OSs Tested on: Ubuntu Linux
 #include <sys/mman.h>
 #include <string.h>
 #include <unistd.h> // For sleep()
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
 
 // Size of shared memory block
 // Pass this to ftruncate and mmap
 #define SHM_SIZE 4096
 
+// Header slots after bufSize, itemCnt, in and out: for each side, a futex word it sleeps
+// on and a flag it raises before sleeping, so that the other side only enters the kernel
+// to wake it when it is actually asleep. The waker clears the flag before FUTEX_WAKE, so
+// later publications skip the syscall; the sleeper raises it again on every round
+#define HDR_PRODUCER_WAKE 4    // The producer sleeps here while the buffer is full
+#define HDR_PRODUCER_WAITING 5
+#define HDR_CONSUMER_WAKE 6    // The consumer sleeps here while the buffer is empty
+#define HDR_CONSUMER_WAITING 7
+
+// Byte offset of each header slot in the shared memory block. in is only written by the
+// producer and out only by the consumer, so each gets a cache line of its own: storing
+// one never takes the line holding the other away from the other side. bufSize and
+// itemCnt are written once, and the wake words of each side share a line
+#define CACHE_LINE 64
+const int gHeaderOffset[] = {
+    0,                            // bufSize
+    sizeof(int),                  // itemCnt
+    CACHE_LINE,                   // in
+    2 * CACHE_LINE,               // out
+    3 * CACHE_LINE,               // HDR_PRODUCER_WAKE
+    3 * CACHE_LINE + sizeof(int), // HDR_PRODUCER_WAITING
+    4 * CACHE_LINE,               // HDR_CONSUMER_WAKE
+    4 * CACHE_LINE + sizeof(int), // HDR_CONSUMER_WAITING
+};
+#define HEADER_SIZE (5 * CACHE_LINE) // The bounded buffer starts on the line after the header
+
+// pause iterations a waiter spins before it parks on the futex (a few microseconds)
+#define SPIN_LIMIT 1024
+
 // Global pointer to the shared memory block
 // This should receive the return value of mmap
 // Don't change this pointer in any function
@@ -35,6 +67,12 @@ int GetOut();
 int GetHeaderVal(int);
 void WriteAtBufIndex(int, int);
 int ReadAtBufIndex(int);
+void CpuRelax();
+atomic_int* HeaderWord(int);
+int WaitForItem(int);
+void WakeWaiter(int, int);
+int ClaimItems(int, int, int, int*);
+int ReleaseItems(int, int, int);
 
 int main()
 {
@@ -42,7 +80,7 @@ int main()
     int shm_fd; // Shared memory file descriptor
     int bufSize; // Bounded buffer size
     int itemCnt; // Number of items to consume
-    int in; // Index of next item to produce
+    int in; // Index of next item to produce, cached: only read again when the buffer looks empty
     int out; // Index of next item to consume
 
     // **Wait for producer to create shared memory**
@@ -90,19 +128,19 @@ int main()
            bufSize, itemCnt, in, out);
 
     // **Consume all items produced by the producer**
-    for (int i = 0; i < itemCnt; i++) {
-        // **Wait until there is an item to consume**
-        while (GetIn() == out) {
-            if (i >= itemCnt - 1) break; // Stop if all items are consumed
-        }
+    for (int i = 0; i < itemCnt; ) {
+        // **Claim the run of items available from out, waiting until there is one**
+        // (the producer writes exactly itemCnt items, so item i always arrives)
+        int count = ClaimItems(out, itemCnt - i, bufSize, &in);
 
-        // **Read item from shared memory buffer**
-        int val = ReadAtBufIndex(out);
-        printf("Consuming Item %d with value %d at Index %d\n", i, val, out);
+        // **Read the items from shared memory buffer**
+        for (int j = 0; j < count; j++, i++) {
+            int val = ReadAtBufIndex(out + j);
+            printf("Consuming Item %d with value %d at Index %d\n", i, val, out + j);
+        }
 
-        // **Update 'out' index and write it back to shared memory**
-        out = (out + 1) % bufSize;
-        SetOut(out);
+        // **Update 'out' index past the run and write it back to shared memory once**
+        out = ReleaseItems(out, count, bufSize);
     }
 
     // **Unmap memory but do NOT unlink (producer should handle this)**
@@ -126,20 +164,18 @@ void SetOut(int val)
     SetHeaderVal(3, val);
 }
 
-// Get the ith value in the header
+// Get the ith value in the header. The load is an acquire and the store in SetHeaderVal
+// a release: once the consumer reads an in, the items written before it was set are
+// visible, and once the producer reads an out, the consumer is done with the slots before it
 int GetHeaderVal(int i)
 {
-    int val;
-    void* ptr = gShmPtr + i * sizeof(int);
-    memcpy(&val, ptr, sizeof(int));
-    return val;
+    return atomic_load_explicit(HeaderWord(i), memory_order_acquire);
 }
 
 // Set the ith value in the header
 void SetHeaderVal(int i, int val)
 {
-    void* ptr = gShmPtr + i * sizeof(int);
-    memcpy(ptr, &val, sizeof(int));
+    atomic_store_explicit(HeaderWord(i), val, memory_order_release);
 }
 
 // Get the value of shared variable "bufSize"
@@ -169,7 +205,7 @@ int GetOut()
 // Write the given val at the given index in the bounded buffer 
 void WriteAtBufIndex(int indx, int val)
 {
-    void* ptr = gShmPtr + 4 * sizeof(int) + indx * sizeof(int);
+    void* ptr = gShmPtr + HEADER_SIZE + indx * sizeof(int);
     memcpy(ptr, &val, sizeof(int));
 }
 
@@ -177,7 +213,94 @@ void WriteAtBufIndex(int indx, int val)
 int ReadAtBufIndex(int indx)
 {
     int val;
-    void* ptr = gShmPtr + 4 * sizeof(int) + indx * sizeof(int);
+    void* ptr = gShmPtr + HEADER_SIZE + indx * sizeof(int);
     memcpy(&val, ptr, sizeof(int));
     return val;
 }
+
+// Let the other hyperthread run while spinning. The memory clobber makes the compiler
+// read the shared header again on every iteration
+void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// The ith header value, as an atomic (and futex word)
+atomic_int* HeaderWord(int i)
+{
+    return (atomic_int*)((char*)gShmPtr + gHeaderOffset[i]);
+}
+
+// Wake the other side if it is parked on its futex word wake (with its flag in waiting).
+// Called after publishing in or out: the fence orders that store before the load of the
+// flag, and the waiter orders its flag before its last look at the index, so one of the
+// two always sees the other
+void WakeWaiter(int wake, int waiting)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(HeaderWord(waiting), memory_order_relaxed)) {
+        atomic_store(HeaderWord(waiting), 0);
+        atomic_fetch_add(HeaderWord(wake), 1);
+        syscall(SYS_futex, HeaderWord(wake), FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// Wait until the item at out has been produced, and return in. Spin for SPIN_LIMIT
+// rounds first, then park on the futex until the producer's WakeWaiter(), the mirror
+// image of the producer's WaitForSpace()
+int WaitForItem(int out)
+{
+    int in;
+
+    for (int spin = 0; spin < SPIN_LIMIT; spin++) {
+        in = GetIn();
+        if (in != out) {
+            return in;
+        }
+        CpuRelax();
+    }
+    while (1) {
+        int wake = atomic_load(HeaderWord(HDR_CONSUMER_WAKE));
+        atomic_store(HeaderWord(HDR_CONSUMER_WAITING), 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        in = GetIn();
+        if (in != out) {
+            atomic_store(HeaderWord(HDR_CONSUMER_WAITING), 0);
+            return in;
+        }
+        syscall(SYS_futex, HeaderWord(HDR_CONSUMER_WAKE), FUTEX_WAIT, wake, NULL, NULL, 0);
+    }
+}
+
+// Claim up to max items from out for reading. The run ends at the end of the buffer at
+// the latest, so it is always contiguous; after a wrap-around the next claim starts at
+// index 0. *in is the caller's cached copy of in: it is read again when the buffer looks
+// empty (waiting until an item arrives) or holds fewer than max items. Returns the
+// number of items claimed, at least 1
+int ClaimItems(int out, int max, int bufSize, int* in)
+{
+    if (*in == out) {
+        *in = WaitForItem(out);
+    }
+    int avail = (*in - out + bufSize) % bufSize;
+    if (avail < max) {
+        *in = GetIn();
+        avail = (*in - out + bufSize) % bufSize;
+    }
+    int count = (avail < max) ? avail : max;
+    return (count < bufSize - out) ? count : bufSize - out;
+}
+
+// Hand the count slots read from out back to the producer with a single store of out,
+// and wake the producer if it is asleep. Returns the new out
+int ReleaseItems(int out, int count, int bufSize)
+{
+    out = (out + count) % bufSize;
+    SetOut(out);
+    WakeWaiter(HDR_PRODUCER_WAKE, HDR_PRODUCER_WAITING); // Only enters the kernel if the producer is asleep
+    return out;
+}
@@ -16,19 +16,51 @@ OSs Tested on: Ubuntu Linux
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
 
 
 // Size of shared memory block
 // Pass this to ftruncate and mmap
 #define SHM_SIZE 4096
 
+// Header slots after bufSize, itemCnt, in and out: for each side, a futex word it sleeps
+// on and a flag it raises before sleeping, so that the other side only enters the kernel
+// to wake it when it is actually asleep. The waker clears the flag before FUTEX_WAKE, so
+// later publications skip the syscall; the sleeper raises it again on every round
+#define HDR_PRODUCER_WAKE 4    // The producer sleeps here while the buffer is full
+#define HDR_PRODUCER_WAITING 5
+#define HDR_CONSUMER_WAKE 6    // The consumer sleeps here while the buffer is empty
+#define HDR_CONSUMER_WAITING 7
+
+// Byte offset of each header slot in the shared memory block. in is only written by the
+// producer and out only by the consumer, so each gets a cache line of its own: storing
+// one never takes the line holding the other away from the other side. bufSize and
+// itemCnt are written once, and the wake words of each side share a line
+#define CACHE_LINE 64
+const int gHeaderOffset[] = {
+    0,                            // bufSize
+    sizeof(int),                  // itemCnt
+    CACHE_LINE,                   // in
+    2 * CACHE_LINE,               // out
+    3 * CACHE_LINE,               // HDR_PRODUCER_WAKE
+    3 * CACHE_LINE + sizeof(int), // HDR_PRODUCER_WAITING
+    4 * CACHE_LINE,               // HDR_CONSUMER_WAKE
+    4 * CACHE_LINE + sizeof(int), // HDR_CONSUMER_WAITING
+};
+#define HEADER_SIZE (5 * CACHE_LINE) // The bounded buffer starts on the line after the header
+
+// pause iterations a waiter spins before it parks on the futex (a few microseconds)
+#define SPIN_LIMIT 1024
+
 // Global pointer to the shared memory block
 // This should receive the return value of mmap
 // Don't change this pointer in any function
 void* gShmPtr;
 
 // You won't necessarily need all the functions below
-void Producer(int, int, int);
+void Producer(int, int, int, int);
 void InitShm(int, int);
 void SetBufSize(int);
 void SetItemCnt(int);
@@ -43,6 +75,12 @@ int GetHeaderVal(int);
 void WriteAtBufIndex(int, int);
 int ReadAtBufIndex(int);
 int GetRand(int, int);
+void CpuRelax();
+atomic_int* HeaderWord(int);
+int WaitForSpace(int, int);
+void WakeWaiter(int, int);
+int ReserveSlots(int, int, int, int*);
+int CommitSlots(int, int, int);
 
 
 int main(int argc, char* argv[])
@@ -51,14 +89,18 @@ int main(int argc, char* argv[])
         int bufSize; // Bounded buffer size
         int itemCnt; // Number of items to be produced
         int randSeed; // Seed for the random number generator 
+        int batch = 1; // Items written per reservation, optional fourth argument
 
-        if(argc != 4){
+        if(argc != 4 && argc != 5){
 		printf("Invalid number of command-line arguments\n");
 		exit(1);
         }
 	bufSize = atoi(argv[1]);
 	itemCnt = atoi(argv[2]);
 	randSeed = atoi(argv[3]);
+	if (argc == 5) {
+		batch = atoi(argv[4]);
+	}
 	
 	// Write code to check the validity of the command-line arguments
         if (bufSize < 2 || bufSize >450) {
@@ -69,6 +111,10 @@ int main(int argc, char* argv[])
                 printf("Invalid command line argument: Item count is not large enough."); 
                 exit(1); 
         }
+        if (batch < 1 || batch > bufSize - 1) {
+                printf("Invalid command line argument: Batch size must be between 1 and the buffer size minus 1."); 
+                exit(1); 
+        }
         // Function that creates a shared memory segment and initializes its header
         InitShm(bufSize, itemCnt);        
 
@@ -88,7 +134,7 @@ int main(int argc, char* argv[])
 		printf("Starting Producer\n");
 		
                // The function that actually implements the production
-               Producer(bufSize, itemCnt, randSeed);
+               Producer(bufSize, itemCnt, randSeed, batch);
 		
 	       printf("Producer done and waiting for consumer\n");
 	       wait(NULL);		
@@ -145,6 +191,10 @@ void InitShm(int bufSize, int itemCnt)
     SetHeaderVal(3, 0);        
     printf("After SetHeaderVal(3, 0), Read Back: %d\n", GetOut());
 
+    for (int i = HDR_PRODUCER_WAKE; i <= HDR_CONSUMER_WAITING; i++) {
+        SetHeaderVal(i, 0);
+    }
+
     // **PRINT ACTUAL MEMORY VALUES AFTER WRITING**
     printf("After writing, memory contains: bufSize = %d, itemCnt = %d, in = %d, out = %d\n",
            GetBufSize(), GetItemCnt(), GetIn(), GetOut());
@@ -153,17 +203,16 @@ void InitShm(int bufSize, int itemCnt)
 
 
 
-void Producer(int bufSize, int itemCnt, int randSeed)
+// Items are written in batches of up to batch slots, and in is published once per batch
+void Producer(int bufSize, int itemCnt, int randSeed, int batch)
 {
     int in = GetIn();  // Initialize in from shared memory
-    int out = GetOut(); // Get initial out value
+    int out = GetOut(); // Cached copy of out: only read again when the buffer looks full
 
     srand(randSeed);
 
-    for (int i = 0; i < itemCnt; i++)
+    for (int i = 0; i < itemCnt; )
     {
-        int val = GetRand(2, 3200); // Generate a random number in the specified range
-
        // Write code here to produce itemCnt integer values in the range specificed in the problem description
        // Use the functions provided below to get/set the values of shared variables "in" and "out"
        // Use the provided function WriteAtBufIndex() to write into the bounded buffer 	
@@ -174,22 +223,22 @@ void Producer(int bufSize, int itemCnt, int randSeed)
        // where i is the item number, val is the item value, in is its index in the bounded buffer
 
 
-        // Wait if the buffer is full (next in == out)
-        while (((in + 1) % bufSize) == out) {
-            out = GetOut(); // Continuously update 'out' while waiting
-        }
+        // Reserve up to batch free slots, waiting if the buffer is full (next in == out)
+        int count = ReserveSlots(in, (itemCnt - i < batch) ? itemCnt - i : batch, bufSize, &out);
 
-        // Write value into shared buffer at index 'in'
-        WriteAtBufIndex(in, val);
+        for (int j = 0; j < count; j++, i++)
+        {
+            int val = GetRand(2, 3200); // Generate a random number in the specified range
 
-        // Print production message
-        printf("Producing Item %d with value %d at Index %d\n", i, val, in);
+            // Write value into shared buffer at index 'in + j'
+            WriteAtBufIndex(in + j, val);
 
-        // Move 'in' forward
-        in = (in + 1) % bufSize;
+            // Print production message
+            printf("Producing Item %d with value %d at Index %d\n", i, val, in + j);
+        }
 
-        // Update shared memory with new 'in' value
-        SetIn(in);
+        // Move 'in' forward past the batch and update shared memory with it once
+        in = CommitSlots(in, count, bufSize);
     }
 
     printf("Producer Completed\n");
@@ -220,21 +269,18 @@ void SetOut(int val)
         SetHeaderVal(3, val);
 }
 
-// Get the ith value in the header
+// Get the ith value in the header. The load is an acquire and the store in SetHeaderVal
+// a release: once the consumer reads an in, the items written before it was set are
+// visible, and once the producer reads an out, the consumer is done with the slots before it
 int GetHeaderVal(int i)
 {
-        int val;
-        void* ptr = gShmPtr + i*sizeof(int);
-        memcpy(&val, ptr, sizeof(int));
-        return val;
+    return atomic_load_explicit(HeaderWord(i), memory_order_acquire);
 }
 
+// Set the ith value in the header
 void SetHeaderVal(int i, int val)
 {
-    void* ptr = gShmPtr + i * sizeof(int);
-
-    memcpy(ptr, &val, sizeof(int));
-
+    atomic_store_explicit(HeaderWord(i), val, memory_order_release);
 }
 
 
@@ -266,16 +312,77 @@ int GetOut()
 // Write the given val at the given index in the bounded buffer 
 void WriteAtBufIndex(int indx, int val)
 {
-        // Skip the four-integer header and go to the given index 
-        void* ptr = gShmPtr + 4*sizeof(int) + indx*sizeof(int);
+        // Skip the header and go to the given index 
+        void* ptr = gShmPtr + HEADER_SIZE + indx*sizeof(int);
 	memcpy(ptr, &val, sizeof(int));
 }
 
 // Read the val at the given index in the bounded buffer
 int ReadAtBufIndex(int indx)
 {
-        // Write the implementation
- 
+        int val;
+        void* ptr = gShmPtr + HEADER_SIZE + indx*sizeof(int);
+        memcpy(&val, ptr, sizeof(int));
+        return val;
+}
+
+// Let the other hyperthread run while spinning. The memory clobber makes the compiler
+// read the shared header again on every iteration
+void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// The ith header value, as an atomic (and futex word)
+atomic_int* HeaderWord(int i)
+{
+    return (atomic_int*)((char*)gShmPtr + gHeaderOffset[i]);
+}
+
+// Wake the other side if it is parked on its futex word wake (with its flag in waiting).
+// Called after publishing in or out: the fence orders that store before the load of the
+// flag, and the waiter orders its flag before its last look at the index, so one of the
+// two always sees the other
+void WakeWaiter(int wake, int waiting)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(HeaderWord(waiting), memory_order_relaxed)) {
+        atomic_store(HeaderWord(waiting), 0);
+        atomic_fetch_add(HeaderWord(wake), 1);
+        syscall(SYS_futex, HeaderWord(wake), FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// Wait until the buffer has room for the item at in, and return out. Spin for
+// SPIN_LIMIT rounds first, since the consumer usually frees a slot quickly, then park
+// on the futex until the consumer's WakeWaiter(). The wake count is read before the
+// flag is raised, so a wake between the last check and the futex call is not lost
+int WaitForSpace(int in, int bufSize)
+{
+    int out;
+
+    for (int spin = 0; spin < SPIN_LIMIT; spin++) {
+        out = GetOut();
+        if (((in + 1) % bufSize) != out) {
+            return out;
+        }
+        CpuRelax();
+    }
+    while (1) {
+        int wake = atomic_load(HeaderWord(HDR_PRODUCER_WAKE));
+        atomic_store(HeaderWord(HDR_PRODUCER_WAITING), 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        out = GetOut();
+        if (((in + 1) % bufSize) != out) {
+            atomic_store(HeaderWord(HDR_PRODUCER_WAITING), 0);
+            return out;
+        }
+        syscall(SYS_futex, HeaderWord(HDR_PRODUCER_WAKE), FUTEX_WAIT, wake, NULL, NULL, 0);
+    }
 }
 
 // Get a random number in the range [x, y]
@@ -285,3 +392,32 @@ int GetRand(int x, int y)
 	r = x + r % (y-x+1);
         return r;
 }
+
+// Reserve up to max slots from in for writing. The slots end at the end of the buffer
+// at the latest, so they are always contiguous; after a wrap-around the next reservation
+// starts at index 0. *out is the caller's cached copy of out: it is read again when the
+// buffer looks full (waiting until a slot is free) or holds fewer than max free slots.
+// Returns the number of slots reserved, at least 1
+int ReserveSlots(int in, int max, int bufSize, int* out)
+{
+    if (((in + 1) % bufSize) == *out) {
+        *out = WaitForSpace(in, bufSize);
+    }
+    int free = (*out - in - 1 + bufSize) % bufSize; // One slot always stays empty
+    if (free < max) {
+        *out = GetOut();
+        free = (*out - in - 1 + bufSize) % bufSize;
+    }
+    int count = (free < max) ? free : max;
+    return (count < bufSize - in) ? count : bufSize - in;
+}
+
+// Publish the count slots written from in with a single store of in, and wake the
+// consumer if it is asleep. Returns the new in
+int CommitSlots(int in, int count, int bufSize)
+{
+    in = (in + count) % bufSize;
+    SetIn(in);
+    WakeWaiter(HDR_CONSUMER_WAKE, HDR_CONSUMER_WAITING); // Only enters the kernel if the consumer is asleep
+    return in;
+}